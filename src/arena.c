@@ -0,0 +1,127 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN     8
+#define ARENA_MAX       (1024 * 1024)   // never grow the block beyond this
+
+struct _toxprpl_arena
+{
+    guint8 *block;
+    gsize size;
+    gsize used;
+    // allocations that did not fit into the block, freed on reset
+    GSList *overflow;
+    gsize overflow_size;
+};
+
+toxprpl_arena *toxprpl_arena_new(gsize size)
+{
+    toxprpl_arena *arena = g_new0(toxprpl_arena, 1);
+    arena->size = MAX(size, ARENA_ALIGN);
+    arena->block = g_malloc(arena->size);
+    return arena;
+}
+
+void toxprpl_arena_free(toxprpl_arena *arena)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+    g_slist_free_full(arena->overflow, g_free);
+    g_free(arena->block);
+    g_free(arena);
+}
+
+void toxprpl_arena_reset(toxprpl_arena *arena)
+{
+    if (arena->overflow != NULL)
+    {
+        gsize needed = arena->used + arena->overflow_size;
+
+        g_slist_free_full(arena->overflow, g_free);
+        arena->overflow = NULL;
+        arena->overflow_size = 0;
+
+        // make the next event of this size fit into a single block
+        if ((needed > arena->size) && (arena->size < ARENA_MAX))
+        {
+            gsize size = arena->size;
+            while ((size < needed) && (size < ARENA_MAX))
+            {
+                size *= 2;
+            }
+            g_free(arena->block);
+            arena->block = g_malloc(size);
+            arena->size = size;
+        }
+    }
+    arena->used = 0;
+}
+
+gpointer toxprpl_arena_alloc(toxprpl_arena *arena, gsize size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(gsize)(ARENA_ALIGN - 1);
+    if (size <= (arena->size - arena->used))
+    {
+        gpointer p = arena->block + arena->used;
+        arena->used += size;
+        return p;
+    }
+
+    gpointer p = g_malloc(size);
+    arena->overflow = g_slist_prepend(arena->overflow, p);
+    arena->overflow_size += size;
+    return p;
+}
+
+gchar *toxprpl_arena_strndup(toxprpl_arena *arena, const gchar *str,
+                             gsize length)
+{
+    gchar *copy = toxprpl_arena_alloc(arena, length + 1);
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+gchar *toxprpl_arena_printf(toxprpl_arena *arena, const gchar *format, ...)
+{
+    va_list args;
+    va_list copy;
+
+    va_start(args, format);
+    va_copy(copy, args);
+    int length = g_vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+
+    gchar *str = toxprpl_arena_alloc(arena, MAX(length, 0) + 1);
+    g_vsnprintf(str, MAX(length, 0) + 1, format, args);
+    va_end(args);
+    return str;
+}
+
+gsize toxprpl_arena_size(toxprpl_arena *arena)
+{
+    return arena->size;
+}
@@ -0,0 +1,52 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOXPRPL_ARENA_H__
+#define __TOXPRPL_ARENA_H__
+
+#include <glib.h>
+
+/*
+ * Bump allocator for scratch data that only lives while an event is being
+ * handled. Nothing is freed individually, toxprpl_arena_reset() releases
+ * everything at once. When an event needed more than the arena had, the
+ * arena grows on reset, so the steady state does not touch the heap.
+ */
+
+typedef struct _toxprpl_arena toxprpl_arena;
+
+toxprpl_arena *toxprpl_arena_new(gsize size);
+void toxprpl_arena_free(toxprpl_arena *arena);
+
+/* invalidates everything that was allocated from the arena */
+void toxprpl_arena_reset(toxprpl_arena *arena);
+
+gpointer toxprpl_arena_alloc(toxprpl_arena *arena, gsize size);
+
+/* copies length bytes (which may contain NULs) and terminates the copy */
+gchar *toxprpl_arena_strndup(toxprpl_arena *arena, const gchar *str,
+                             gsize length);
+
+gchar *toxprpl_arena_printf(toxprpl_arena *arena, const gchar *format, ...)
+    G_GNUC_PRINTF(2, 3);
+
+/* bytes the arena can hand out without going to the heap */
+gsize toxprpl_arena_size(toxprpl_arena *arena);
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "chat.h"
+
+// part of the key added to names which are taken already
+#define CHAT_NAME_KEY_LEN   8
+
+static void put_u32(guint8 *p, guint32 value)
+{
+    p[0] = (value >> 24) & 0xff;
+    p[1] = (value >> 16) & 0xff;
+    p[2] = (value >> 8) & 0xff;
+    p[3] = value & 0xff;
+}
+
+static guint32 get_u32(const guint8 *p)
+{
+    return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) |
+           ((guint32)p[2] << 8) | (guint32)p[3];
+}
+
+gboolean toxprpl_chat_decode(const guint8 *buf, guint32 length,
+                             toxprpl_chat_msg *msg)
+{
+    if ((length < TOXPRPL_CHAT_HEADER_LEN) || (buf[0] == TOXPRPL_CHAT_INVALID) ||
+        (buf[0] > TOXPRPL_CHAT_NICK))
+    {
+        return FALSE;
+    }
+
+    msg->op = buf[0];
+    msg->flags = buf[1];
+    msg->room = get_u32(buf + 2);
+    msg->key = buf + 6;
+    msg->text = (const gchar *)buf + TOXPRPL_CHAT_HEADER_LEN;
+    msg->length = length - TOXPRPL_CHAT_HEADER_LEN;
+    return TRUE;
+}
+
+GBytes *toxprpl_chat_encode(const toxprpl_chat_msg *msg)
+{
+    if (msg->length > TOXPRPL_CHAT_TEXT_MAX)
+    {
+        return NULL;
+    }
+
+    guint8 *buf = g_malloc(TOXPRPL_CHAT_HEADER_LEN + msg->length);
+    buf[0] = msg->op;
+    buf[1] = msg->flags;
+    put_u32(buf + 2, msg->room);
+    if (msg->key != NULL)
+    {
+        memcpy(buf + 6, msg->key, TOXPRPL_CHAT_KEY_LEN);
+    }
+    else
+    {
+        memset(buf + 6, 0, TOXPRPL_CHAT_KEY_LEN);
+    }
+    memcpy(buf + TOXPRPL_CHAT_HEADER_LEN, msg->text, msg->length);
+    return g_bytes_new_take(buf, TOXPRPL_CHAT_HEADER_LEN + msg->length);
+}
+
+gboolean toxprpl_chat_entry_append(GByteArray *text, const guint8 *key,
+                                   const gchar *name)
+{
+    guint8 length = MIN(strlen(name), G_MAXUINT8);
+
+    if (text->len + TOXPRPL_CHAT_KEY_LEN + 1 + length > TOXPRPL_CHAT_TEXT_MAX)
+    {
+        return FALSE;
+    }
+    g_byte_array_append(text, key, TOXPRPL_CHAT_KEY_LEN);
+    g_byte_array_append(text, &length, 1);
+    g_byte_array_append(text, (const guint8 *)name, length);
+    return TRUE;
+}
+
+gboolean toxprpl_chat_entry_next(const toxprpl_chat_msg *msg, guint *pos,
+                                 const guint8 **key, const gchar **name,
+                                 guint *name_length)
+{
+    const guint8 *p = (const guint8 *)msg->text + *pos;
+    guint left = msg->length - *pos;
+
+    if ((*pos >= msg->length) || (left < TOXPRPL_CHAT_KEY_LEN + 1) ||
+        (left < TOXPRPL_CHAT_KEY_LEN + 1 + p[TOXPRPL_CHAT_KEY_LEN]))
+    {
+        return FALSE;
+    }
+
+    *key = p;
+    *name_length = p[TOXPRPL_CHAT_KEY_LEN];
+    *name = (const gchar *)p + TOXPRPL_CHAT_KEY_LEN + 1;
+    *pos += TOXPRPL_CHAT_KEY_LEN + 1 + *name_length;
+    return TRUE;
+}
+
+static void chat_member_free(gpointer data)
+{
+    toxprpl_chat_member *member = (toxprpl_chat_member *)data;
+    g_free(member->name);
+    g_free(member);
+}
+
+toxprpl_chat *toxprpl_chat_new(int id, guint32 room, int hub,
+                               const gchar *name)
+{
+    toxprpl_chat *chat = g_new0(toxprpl_chat, 1);
+    chat->id = id;
+    chat->room = room;
+    chat->hub = hub;
+    chat->name = g_strdup(name);
+    chat->members = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                          chat_member_free);
+    chat->names = g_hash_table_new(g_str_hash, g_str_equal);
+    chat->invited = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          NULL);
+    return chat;
+}
+
+void toxprpl_chat_free(toxprpl_chat *chat)
+{
+    if (chat == NULL)
+    {
+        return;
+    }
+    g_hash_table_destroy(chat->names);
+    g_hash_table_destroy(chat->members);
+    g_hash_table_destroy(chat->invited);
+    g_free(chat->name);
+    g_free(chat);
+}
+
+static gchar *chat_unique_name(toxprpl_chat *chat, const gchar *key,
+                               const gchar *nick)
+{
+    gchar *base;
+    gchar *name;
+    guint n = 1;
+
+    if ((nick == NULL) || (*nick == '\0'))
+    {
+        base = g_strndup(key, CHAT_NAME_KEY_LEN);
+    }
+    else
+    {
+        base = g_strdup(nick);
+    }
+    if (g_hash_table_lookup(chat->names, base) == NULL)
+    {
+        return base;
+    }
+
+    // somebody may be called like our fallback already, count up until free
+    name = g_strdup_printf("%s (%.*s)", base, CHAT_NAME_KEY_LEN, key);
+    while (g_hash_table_lookup(chat->names, name) != NULL)
+    {
+        g_free(name);
+        name = g_strdup_printf("%s (%.*s) %u", base, CHAT_NAME_KEY_LEN, key,
+                               ++n);
+    }
+    g_free(base);
+    return name;
+}
+
+toxprpl_chat_member *toxprpl_chat_member_add(toxprpl_chat *chat,
+                                             const guint8 *id, int fnum,
+                                             const gchar *nick)
+{
+    static const gchar hex[] = "0123456789abcdef";
+    toxprpl_chat_member *member = g_new0(toxprpl_chat_member, 1);
+    int i;
+
+    memcpy(member->id, id, TOXPRPL_CHAT_KEY_LEN);
+    for (i = 0; i < TOXPRPL_CHAT_KEY_LEN; i++)
+    {
+        member->key[i * 2] = hex[id[i] >> 4];
+        member->key[i * 2 + 1] = hex[id[i] & 0x0f];
+    }
+    member->key[TOXPRPL_CHAT_KEY_LEN * 2] = '\0';
+
+    if (g_hash_table_lookup(chat->members, member->key) != NULL)
+    {
+        g_free(member);
+        return NULL;
+    }
+
+    member->fnum = fnum;
+    member->name = chat_unique_name(chat, member->key, nick);
+    g_hash_table_insert(chat->members, member->key, member);
+    g_hash_table_insert(chat->names, member->name, member);
+    return member;
+}
+
+toxprpl_chat_member *toxprpl_chat_member_find(toxprpl_chat *chat,
+                                              const gchar *key)
+{
+    return g_hash_table_lookup(chat->members, key);
+}
+
+void toxprpl_chat_member_remove(toxprpl_chat *chat,
+                                toxprpl_chat_member *member)
+{
+    g_hash_table_remove(chat->names, member->name);
+    g_hash_table_remove(chat->members, member->key);
+}
+
+gchar *toxprpl_chat_member_rename(toxprpl_chat *chat,
+                                  toxprpl_chat_member *member,
+                                  const gchar *nick)
+{
+    if ((nick != NULL) && !strcmp(member->name, nick))
+    {
+        return NULL;
+    }
+
+    gchar *old = member->name;
+    g_hash_table_remove(chat->names, old);
+    member->name = chat_unique_name(chat, member->key, nick);
+    g_hash_table_insert(chat->names, member->name, member);
+    if (!strcmp(old, member->name))
+    {
+        g_free(old);
+        return NULL;
+    }
+    return old;
+}
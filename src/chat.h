@@ -0,0 +1,137 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOXPRPL_CHAT_H__
+#define __TOXPRPL_CHAT_H__
+
+#include <glib.h>
+
+#include "frame.h"
+
+/*
+ * Group chats on top of the reliable channel. Tox itself has no group
+ * chats, so the peer that creates a room acts as its hub: members only talk
+ * to the hub, which relays messages and membership changes to everybody
+ * else. Members therefore do not have to be friends with each other.
+ *
+ * Chat payloads are sent in DATA frames with TOXPRPL_DATA_CHAT set:
+ * op (1 byte) | flags (1 byte) | room (4 bytes) | key (32 bytes) | text
+ *
+ * The room id is chosen by the hub, so a room is only identified by the hub
+ * together with the id. Everything the hub sends carries
+ * TOXPRPL_CHAT_FROM_HUB, which tells a room we are a member of apart from
+ * one we host that happens to have the same id.
+ *
+ * Membership is only ever sent as changes, a new member gets the current
+ * list as a few MEMBERS messages and ADD, DEL and NICK afterwards.
+ */
+#define TOXPRPL_CHAT_KEY_LEN        32
+#define TOXPRPL_CHAT_KEY_STR_LEN    (TOXPRPL_CHAT_KEY_LEN * 2 + 1)
+#define TOXPRPL_CHAT_HEADER_LEN     (6 + TOXPRPL_CHAT_KEY_LEN)
+#define TOXPRPL_CHAT_TEXT_MAX       (TOXPRPL_FRAME_DATA_MAX - \
+                                     TOXPRPL_CHAT_HEADER_LEN)
+
+#define TOXPRPL_CHAT_FROM_HUB       0x01
+
+typedef enum
+{
+    TOXPRPL_CHAT_INVALID = 0,
+    TOXPRPL_CHAT_INVITE,    // hub to friend, text is the room name
+    TOXPRPL_CHAT_JOIN,      // invited friend to hub
+    TOXPRPL_CHAT_LEAVE,     // member to hub
+    TOXPRPL_CHAT_CLOSE,     // hub to members, the room is gone
+    TOXPRPL_CHAT_MSG,       // member to hub, relayed with the author's key
+    TOXPRPL_CHAT_MEMBERS,   // hub to a new member, a batch of member entries
+    TOXPRPL_CHAT_ADD,       // hub to members, key joined as text
+    TOXPRPL_CHAT_DEL,       // hub to members, key left
+    TOXPRPL_CHAT_NICK       // hub to members, key is now called text
+} toxprpl_chat_op;
+
+typedef struct
+{
+    toxprpl_chat_op op;
+    guint8 flags;
+    guint32 room;
+    const guint8 *key;      // NULL when encoding means all zero
+    const gchar *text;      // not terminated, may be binary for MEMBERS
+    guint16 length;
+} toxprpl_chat_msg;
+
+/* returns TRUE if the payload could be parsed, pointers refer to buf */
+gboolean toxprpl_chat_decode(const guint8 *buf, guint32 length,
+                             toxprpl_chat_msg *msg);
+
+/*
+ * encodes the payload once so it can be queued for every member, returns
+ * NULL if the text does not fit
+ */
+GBytes *toxprpl_chat_encode(const toxprpl_chat_msg *msg);
+
+/*
+ * MEMBERS text is a list of entries: key (32 bytes) | name length (1 byte) |
+ * name. Append returns FALSE if the entry does not fit anymore, next
+ * returns FALSE at the end of the list or on garbage.
+ */
+gboolean toxprpl_chat_entry_append(GByteArray *text, const guint8 *key,
+                                   const gchar *name);
+gboolean toxprpl_chat_entry_next(const toxprpl_chat_msg *msg, guint *pos,
+                                 const guint8 **key, const gchar **name,
+                                 guint *name_length);
+
+typedef struct
+{
+    guint8 id[TOXPRPL_CHAT_KEY_LEN];
+    gchar key[TOXPRPL_CHAT_KEY_STR_LEN];
+    int fnum;       // friend number, only used by the hub, -1 otherwise
+    gchar *name;    // shown in the conversation, unique within the room
+} toxprpl_chat_member;
+
+typedef struct
+{
+    int id;         // libpurple chat id
+    guint32 room;   // chosen by the hub
+    int hub;        // friend number of the hub, -1 if we are the hub
+    gchar *name;
+    GHashTable *members;    // key -> toxprpl_chat_member
+    GHashTable *names;      // shown name -> toxprpl_chat_member
+    GHashTable *invited;    // hub only, keys which may join
+} toxprpl_chat;
+
+toxprpl_chat *toxprpl_chat_new(int id, guint32 room, int hub,
+                               const gchar *name);
+void toxprpl_chat_free(toxprpl_chat *chat);
+
+/*
+ * returns NULL if the key is a member already. The shown name is the nick,
+ * made unique with a part of the key if needed.
+ */
+toxprpl_chat_member *toxprpl_chat_member_add(toxprpl_chat *chat,
+                                             const guint8 *id, int fnum,
+                                             const gchar *nick);
+toxprpl_chat_member *toxprpl_chat_member_find(toxprpl_chat *chat,
+                                              const gchar *key);
+void toxprpl_chat_member_remove(toxprpl_chat *chat,
+                                toxprpl_chat_member *member);
+
+/* returns the previous name (free it) or NULL if the name did not change */
+gchar *toxprpl_chat_member_rename(toxprpl_chat *chat,
+                                  toxprpl_chat_member *member,
+                                  const gchar *nick);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+
+#ifdef HAVE_CONFIG_H
+#include "autoconfig.h"
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "compress.h"
+
+#ifdef HAVE_LZ4
+#define COMPRESS_HEADER_LEN     2
+
+/*
+ * Shared by all peers, changing it breaks compatibility. LZ4 finds matches
+ * near the end of the dictionary cheaper, so the most common bits go last.
+ */
+static const char compress_dict[] =
+    "Traceback (most recent call last):\n  File \"\", line , in \n"
+    "Exception in thread \"main\" java.lang.NullPointerException\n"
+    "\tat java.lang.Thread.run(Thread.java:)\n"
+    "#0  0x0000000000000000 in  () from /usr/lib/\n"
+    "Segmentation fault (core dumped)\n"
+    "warning: unused variable error: expected ';' before \n"
+    "make: *** [all] Error 1\n"
+    "[ERROR] [WARN] [INFO] [DEBUG] ERROR: WARNING: INFO: DEBUG: \n"
+    "2013-01-01 00:00:00,000 INFO  2013-01-01T00:00:00Z \n"
+    "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n"
+    "int main(int argc, char *argv[])\n{\n    return 0;\n}\n"
+    "    if () {\n    } else {\n    }\n    for (i = 0; i < ; i++)\n"
+    "def __init__(self):\n        self.\n    return None\n"
+    "function () { return; }\nvar = null; undefined\n"
+    "<html><head></head><body></body></html>\n<div class=\"\"></div>\n"
+    "{\"id\": , \"name\": \"\", \"type\": \"\", \"value\": true, false}\n"
+    "[section]\nenabled = true\nport = 8080\nhost = localhost\n"
+    "http://www. https://github.com/ .com/ .org/ .html .php?id=\n"
+    "the and that have for not with you this but his from they say her "
+    "she will one all would there their what about which when make can "
+    "like time just know take people into year your good some could them "
+    "see other than then now look only come its over think also back "
+    "after use two how our work first well way even new want because "
+    "any these give day most thanks please sorry yes no ok okay lol ";
+
+static LZ4_stream_t *compress_stream = NULL;
+
+static void put_u16(guint8 *p, guint16 value)
+{
+    p[0] = (value >> 8) & 0xff;
+    p[1] = value & 0xff;
+}
+
+static guint16 get_u16(const guint8 *p)
+{
+    return ((guint16)p[0] << 8) | (guint16)p[1];
+}
+#endif
+
+gboolean toxprpl_compress_available(void)
+{
+#ifdef HAVE_LZ4
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+gsize toxprpl_compress_buffer(const guint8 *data, gsize length, guint8 *out,
+                              gsize size)
+{
+#ifdef HAVE_LZ4
+    if ((length < TOXPRPL_COMPRESS_THRESHOLD) || (length > G_MAXUINT16))
+    {
+        return 0;
+    }
+
+    // not worth it unless it saves at least an eighth
+    gsize limit = MIN(length - length / 8, size);
+    if (limit <= COMPRESS_HEADER_LEN)
+    {
+        return 0;
+    }
+
+    if (compress_stream == NULL)
+    {
+        compress_stream = LZ4_createStream();
+    }
+    // every payload is compressed on its own, against the dictionary only
+    LZ4_loadDict(compress_stream, compress_dict, sizeof(compress_dict) - 1);
+
+    int packed = LZ4_compress_fast_continue(compress_stream,
+            (const char *)data, (char *)out + COMPRESS_HEADER_LEN, length,
+            limit - COMPRESS_HEADER_LEN, 1);
+    if (packed <= 0)
+    {
+        return 0;
+    }
+    put_u16(out, length);
+    return COMPRESS_HEADER_LEN + packed;
+#else
+    return 0;
+#endif
+}
+
+GBytes *toxprpl_compress(GBytes *payload)
+{
+    gsize length;
+    const guint8 *data = g_bytes_get_data(payload, &length);
+
+    if (!toxprpl_compress_available() ||
+        (length < TOXPRPL_COMPRESS_THRESHOLD))
+    {
+        return NULL;
+    }
+
+    // toxprpl_compress_buffer() never returns more than this
+    gsize size = length - length / 8;
+    guint8 *buf = g_malloc(size);
+    gsize packed = toxprpl_compress_buffer(data, length, buf, size);
+    if (packed == 0)
+    {
+        g_free(buf);
+        return NULL;
+    }
+    return g_bytes_new_take(buf, packed);
+}
+
+gssize toxprpl_decompressed_length(const guint8 *data, gsize length)
+{
+#ifdef HAVE_LZ4
+    if (length < COMPRESS_HEADER_LEN)
+    {
+        return -1;
+    }
+    return get_u16(data);
+#else
+    return -1;
+#endif
+}
+
+gssize toxprpl_decompress(const guint8 *data, gsize length, guint8 *out,
+                          gsize size)
+{
+#ifdef HAVE_LZ4
+    if (length < COMPRESS_HEADER_LEN)
+    {
+        return -1;
+    }
+
+    guint16 original = get_u16(data);
+    if (original > size)
+    {
+        return -1;
+    }
+
+    int n = LZ4_decompress_safe_usingDict((const char *)data +
+            COMPRESS_HEADER_LEN, (char *)out, length - COMPRESS_HEADER_LEN,
+            original, compress_dict, sizeof(compress_dict) - 1);
+    return (n == original) ? n : -1;
+#else
+    return -1;
+#endif
+}
+
+void toxprpl_compress_cleanup(void)
+{
+#ifdef HAVE_LZ4
+    if (compress_stream != NULL)
+    {
+        LZ4_freeStream(compress_stream);
+        compress_stream = NULL;
+    }
+#endif
+}
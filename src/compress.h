@@ -0,0 +1,64 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOXPRPL_COMPRESS_H__
+#define __TOXPRPL_COMPRESS_H__
+
+#include <glib.h>
+
+/*
+ * Optional LZ4 compression of DATA frame payloads between tox-prpl peers.
+ * A message too long for one frame is compressed as a whole and the result
+ * is split into parts, see toxprpl_reliable_send().
+ * Both sides use the same built in dictionary, so even short messages
+ * such as a few lines of a log shrink. Without liblz4 nothing is
+ * compressed and TOXPRPL_CAP_LZ4 is not announced.
+ *
+ * Layout: original length (2 bytes, big endian) | LZ4 block
+ */
+
+// smaller payloads are sent as they are
+#define TOXPRPL_COMPRESS_THRESHOLD  128
+
+gboolean toxprpl_compress_available(void);
+
+/* returns the compressed payload or NULL if compression does not pay off */
+GBytes *toxprpl_compress(GBytes *payload);
+
+/*
+ * compresses into out, returns the length written or 0 if compression does
+ * not pay off within size bytes
+ */
+gsize toxprpl_compress_buffer(const guint8 *data, gsize length, guint8 *out,
+                              gsize size);
+
+/* returns the length of the original payload, -1 if data is too short */
+gssize toxprpl_decompressed_length(const guint8 *data, gsize length);
+
+/*
+ * returns the length of the original payload written to out, -1 if the data
+ * is corrupt or the original does not fit into size bytes
+ */
+gssize toxprpl_decompress(const guint8 *data, gsize length, guint8 *out,
+                          gsize size);
+
+/* releases the compressor state */
+void toxprpl_compress_cleanup(void);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "frame.h"
+
+static void put_u32(guint8 *p, guint32 value)
+{
+    p[0] = (value >> 24) & 0xff;
+    p[1] = (value >> 16) & 0xff;
+    p[2] = (value >> 8) & 0xff;
+    p[3] = value & 0xff;
+}
+
+static guint32 get_u32(const guint8 *p)
+{
+    return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) |
+           ((guint32)p[2] << 8) | (guint32)p[3];
+}
+
+gboolean toxprpl_frame_is_frame(const guint8 *buf, guint32 length)
+{
+    return (length >= TOXPRPL_FRAME_HEADER_LEN) &&
+           (memcmp(buf, TOXPRPL_FRAME_MAGIC, TOXPRPL_FRAME_MAGIC_LEN) == 0);
+}
+
+gboolean toxprpl_frame_decode(const guint8 *buf, guint32 length,
+                              toxprpl_frame *frame)
+{
+    if (!toxprpl_frame_is_frame(buf, length))
+    {
+        return FALSE;
+    }
+
+    // newer versions must stay backwards compatible with the layout below
+    if (buf[TOXPRPL_FRAME_MAGIC_LEN] < TOXPRPL_FRAME_VERSION)
+    {
+        return FALSE;
+    }
+
+    const guint8 *p = buf + TOXPRPL_FRAME_HEADER_LEN;
+    guint32 left = length - TOXPRPL_FRAME_HEADER_LEN;
+
+    frame->type = buf[TOXPRPL_FRAME_MAGIC_LEN + 1];
+    switch (frame->type)
+    {
+        case TOXPRPL_FRAME_HELLO:
+            if (left < 12)
+            {
+                return FALSE;
+            }
+            frame->u.hello.caps = get_u32(p);
+            frame->u.hello.epoch = get_u32(p + 4);
+            frame->u.hello.tx_base = get_u32(p + 8);
+            return TRUE;
+
+        case TOXPRPL_FRAME_DATA:
+            if (left < 5)
+            {
+                return FALSE;
+            }
+            frame->u.data.seq = get_u32(p);
+            frame->u.data.flags = p[4];
+            frame->u.data.payload = p + 5;
+            frame->u.data.length = left - 5;
+            return TRUE;
+
+        case TOXPRPL_FRAME_ACK:
+            if (left < 8)
+            {
+                return FALSE;
+            }
+            frame->u.ack.next = get_u32(p);
+            frame->u.ack.mask = get_u32(p + 4);
+            return TRUE;
+
+        case TOXPRPL_FRAME_ICON:
+        case TOXPRPL_FRAME_ICON_GET:
+        case TOXPRPL_FRAME_ICON_DATA:
+            if (left < TOXPRPL_ICON_HASH_LEN + 8)
+            {
+                return FALSE;
+            }
+            frame->u.icon.hash = p;
+            p += TOXPRPL_ICON_HASH_LEN;
+            frame->u.icon.offset = get_u32(p);
+            frame->u.icon.size = get_u32(p + 4);
+            frame->u.icon.payload = p + 8;
+            frame->u.icon.length = (frame->type == TOXPRPL_FRAME_ICON_DATA) ?
+                    left - TOXPRPL_ICON_HASH_LEN - 8 : 0;
+            return TRUE;
+
+        case TOXPRPL_FRAME_TYPING:
+            if (left < 1)
+            {
+                return FALSE;
+            }
+            frame->u.typing.state = p[0];
+            return TRUE;
+
+        default:
+            break;
+    }
+
+    frame->type = TOXPRPL_FRAME_INVALID;
+    return FALSE;
+}
+
+guint32 toxprpl_frame_encode(const toxprpl_frame *frame, guint8 *buf,
+                             guint32 size)
+{
+    guint32 length = TOXPRPL_FRAME_HEADER_LEN;
+    guint8 *p = buf + TOXPRPL_FRAME_HEADER_LEN;
+
+    switch (frame->type)
+    {
+        case TOXPRPL_FRAME_HELLO:
+            length += 12;
+            break;
+        case TOXPRPL_FRAME_DATA:
+            length += 5 + frame->u.data.length;
+            break;
+        case TOXPRPL_FRAME_ACK:
+            length += 8;
+            break;
+        case TOXPRPL_FRAME_ICON:
+        case TOXPRPL_FRAME_ICON_GET:
+            length += TOXPRPL_ICON_HASH_LEN + 8;
+            break;
+        case TOXPRPL_FRAME_ICON_DATA:
+            length += TOXPRPL_ICON_HASH_LEN + 8 + frame->u.icon.length;
+            break;
+        case TOXPRPL_FRAME_TYPING:
+            length += 1;
+            break;
+        default:
+            return 0;
+    }
+
+    if ((length > size) || (length > TOXPRPL_FRAME_MAX))
+    {
+        return 0;
+    }
+
+    memcpy(buf, TOXPRPL_FRAME_MAGIC, TOXPRPL_FRAME_MAGIC_LEN);
+    buf[TOXPRPL_FRAME_MAGIC_LEN] = TOXPRPL_FRAME_VERSION;
+    buf[TOXPRPL_FRAME_MAGIC_LEN + 1] = frame->type;
+
+    switch (frame->type)
+    {
+        case TOXPRPL_FRAME_HELLO:
+            put_u32(p, frame->u.hello.caps);
+            put_u32(p + 4, frame->u.hello.epoch);
+            put_u32(p + 8, frame->u.hello.tx_base);
+            break;
+        case TOXPRPL_FRAME_DATA:
+            put_u32(p, frame->u.data.seq);
+            p[4] = frame->u.data.flags;
+            memcpy(p + 5, frame->u.data.payload, frame->u.data.length);
+            break;
+        case TOXPRPL_FRAME_ACK:
+            put_u32(p, frame->u.ack.next);
+            put_u32(p + 4, frame->u.ack.mask);
+            break;
+        case TOXPRPL_FRAME_ICON:
+        case TOXPRPL_FRAME_ICON_GET:
+        case TOXPRPL_FRAME_ICON_DATA:
+            memcpy(p, frame->u.icon.hash, TOXPRPL_ICON_HASH_LEN);
+            p += TOXPRPL_ICON_HASH_LEN;
+            put_u32(p, frame->u.icon.offset);
+            put_u32(p + 4, frame->u.icon.size);
+            if (frame->type == TOXPRPL_FRAME_ICON_DATA)
+            {
+                memcpy(p + 8, frame->u.icon.payload, frame->u.icon.length);
+            }
+            break;
+        case TOXPRPL_FRAME_TYPING:
+            p[0] = frame->u.typing.state;
+            break;
+        default:
+            break;
+    }
+
+    return length;
+}
@@ -0,0 +1,135 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOXPRPL_FRAME_H__
+#define __TOXPRPL_FRAME_H__
+
+#include <glib.h>
+
+/*
+ * tox-prpl peers talk to each other by sending specially marked messages
+ * through m_sendmessage(). A frame starts with a NUL byte, so other Tox
+ * clients which treat messages as C strings see an empty message and
+ * nothing else.
+ *
+ * Layout: "\0TXP" | version (1 byte) | type (1 byte) | type specific body,
+ * all integers are big endian.
+ */
+#define TOXPRPL_FRAME_MAGIC         "\0TXP"
+#define TOXPRPL_FRAME_MAGIC_LEN     4
+#define TOXPRPL_FRAME_VERSION       1
+#define TOXPRPL_FRAME_HEADER_LEN    (TOXPRPL_FRAME_MAGIC_LEN + 2)
+
+// stay well below the maximum size of a single tox message
+#define TOXPRPL_FRAME_MAX           1000
+
+#define TOXPRPL_FRAME_DATA_HEADER_LEN   (TOXPRPL_FRAME_HEADER_LEN + 5)
+#define TOXPRPL_FRAME_DATA_MAX          (TOXPRPL_FRAME_MAX - \
+                                         TOXPRPL_FRAME_DATA_HEADER_LEN)
+
+// icon frames: sha256 of the icon | offset | size | data (ICON_DATA only)
+#define TOXPRPL_ICON_HASH_LEN       32
+#define TOXPRPL_FRAME_ICON_HEADER_LEN   (TOXPRPL_FRAME_HEADER_LEN + \
+                                         TOXPRPL_ICON_HASH_LEN + 8)
+#define TOXPRPL_FRAME_ICON_DATA_MAX     (TOXPRPL_FRAME_MAX - \
+                                         TOXPRPL_FRAME_ICON_HEADER_LEN)
+
+// capabilities announced in the hello frame
+#define TOXPRPL_CAP_RECEIPTS        (1 << 0)
+#define TOXPRPL_CAP_ICONS           (1 << 1)
+#define TOXPRPL_CAP_CHAT            (1 << 2)
+#define TOXPRPL_CAP_LZ4             (1 << 3)    // see compress.h
+#define TOXPRPL_CAP_TYPING          (1 << 4)
+
+// DATA frame flags
+#define TOXPRPL_DATA_CHAT           (1 << 0)    // payload is for a group chat
+#define TOXPRPL_DATA_LZ4            (1 << 1)    // payload is compressed
+// a message longer than one frame is sent as parts with consecutive
+// sequence numbers: MORE on all but the last, CONT on all but the first
+#define TOXPRPL_DATA_MORE           (1 << 2)
+#define TOXPRPL_DATA_CONT           (1 << 3)
+
+// TYPING frame states, sent when the state changes and repeated now and
+// then while it lasts, receivers forget a state which was not repeated
+#define TOXPRPL_TYPING_NONE         0
+#define TOXPRPL_TYPING_ACTIVE       1
+#define TOXPRPL_TYPING_PAUSED       2
+
+typedef enum
+{
+    TOXPRPL_FRAME_INVALID = 0,
+    TOXPRPL_FRAME_HELLO,    // capabilities, session epoch, next tx sequence
+    TOXPRPL_FRAME_DATA,     // sequence numbered chat message
+    TOXPRPL_FRAME_ACK,      // cumulative acknowledgement + selective mask
+    TOXPRPL_FRAME_ICON,     // hash and size of the current icon, 0 for none
+    TOXPRPL_FRAME_ICON_GET, // asks for the part of an icon at offset
+    TOXPRPL_FRAME_ICON_DATA, // part of an icon
+    TOXPRPL_FRAME_TYPING    // typing state of the sender
+} toxprpl_frame_type;
+
+typedef struct
+{
+    toxprpl_frame_type type;
+    union
+    {
+        struct
+        {
+            guint32 caps;
+            guint32 epoch;
+            guint32 tx_base;
+        } hello;
+        struct
+        {
+            guint32 seq;
+            guint8 flags;
+            const guint8 *payload; // points into the decoded buffer
+            guint16 length;
+        } data;
+        struct
+        {
+            guint32 next;   // everything below this sequence was received
+            guint32 mask;   // bit i set: sequence next + i was received
+        } ack;
+        struct
+        {
+            const guint8 *hash;     // TOXPRPL_ICON_HASH_LEN bytes
+            guint32 offset;
+            guint32 size;           // of the whole icon
+            const guint8 *payload;  // ICON_DATA only
+            guint16 length;
+        } icon;
+        struct
+        {
+            guint8 state;
+        } typing;
+    } u;
+} toxprpl_frame;
+
+/* returns TRUE if the message carries a tox-prpl frame */
+gboolean toxprpl_frame_is_frame(const guint8 *buf, guint32 length);
+
+/* returns TRUE if the frame could be parsed, payload pointers refer to buf */
+gboolean toxprpl_frame_decode(const guint8 *buf, guint32 length,
+                              toxprpl_frame *frame);
+
+/* returns number of bytes written to buf or 0 if buf is too small */
+guint32 toxprpl_frame_encode(const toxprpl_frame *frame, guint8 *buf,
+                             guint32 size);
+
+#endif
@@ -0,0 +1,557 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <glib.h>
+
+#ifdef HAVE_CONFIG_H
+#include "autoconfig.h"
+#endif
+
+#include <debug.h>
+#include <eventloop.h>
+
+#include "gateway.h"
+
+#define GATEWAY_READ_CHUNK      65536
+// clients which do not read their events are dropped, we do not buffer
+// forever on their behalf
+#define GATEWAY_MAX_OUTPUT      (4 * 1024 * 1024)
+#define GATEWAY_MAX_LINE        (64 * 1024)
+// upper bound of what is read in one go, the rest is picked up by the next
+// callback so a busy client can not starve the main loop
+#define GATEWAY_MAX_READ_CHUNKS 16
+
+typedef struct
+{
+    toxprpl_gateway *gateway;
+    int fd;
+    guint read_handle;
+    guint write_handle;
+    GString *in;
+    GString *out;
+} gateway_client;
+
+struct _toxprpl_gateway
+{
+    gchar *path;
+    int fd;
+    guint accept_handle;
+    GList *clients;
+    gateway_client *current;
+    toxprpl_gateway_ops ops;
+};
+
+static void gateway_client_write_cb(gpointer data, gint fd,
+                                    PurpleInputCondition cond);
+
+static int gateway_set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+    {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void gateway_append_escaped(GString *out, const char *text)
+{
+    const char *p;
+    for (p = text; *p != '\0'; p++)
+    {
+        switch (*p)
+        {
+            case '\\':
+                g_string_append_len(out, "\\\\", 2);
+                break;
+            case '\n':
+                g_string_append_len(out, "\\n", 2);
+                break;
+            case '\r':
+                g_string_append_len(out, "\\r", 2);
+                break;
+            default:
+                g_string_append_c(out, *p);
+                break;
+        }
+    }
+}
+
+/* unescapes in place, the result is never longer than the input */
+static void gateway_unescape(char *text)
+{
+    char *in = text;
+    char *out = text;
+    while (*in != '\0')
+    {
+        if ((in[0] == '\\') && (in[1] != '\0'))
+        {
+            switch (in[1])
+            {
+                case 'n':
+                    *out++ = '\n';
+                    break;
+                case 'r':
+                    *out++ = '\r';
+                    break;
+                default:
+                    *out++ = in[1];
+                    break;
+            }
+            in += 2;
+        }
+        else
+        {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+static void gateway_client_free(gateway_client *client)
+{
+    toxprpl_gateway *gateway = client->gateway;
+
+    gateway->clients = g_list_remove(gateway->clients, client);
+    if (gateway->current == client)
+    {
+        gateway->current = NULL;
+    }
+    if (client->read_handle != 0)
+    {
+        purple_input_remove(client->read_handle);
+    }
+    if (client->write_handle != 0)
+    {
+        purple_input_remove(client->write_handle);
+    }
+    close(client->fd);
+    g_string_free(client->in, TRUE);
+    g_string_free(client->out, TRUE);
+    g_free(client);
+}
+
+/* returns FALSE if the client was dropped */
+static gboolean gateway_client_flush(gateway_client *client)
+{
+    gsize written = 0;
+
+    while (written < client->out->len)
+    {
+        ssize_t ret = write(client->fd, client->out->str + written,
+                            client->out->len - written);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            purple_debug_info("toxprpl", "gateway: write failed: %s\n",
+                              strerror(errno));
+            gateway_client_free(client);
+            return FALSE;
+        }
+        written += ret;
+    }
+    g_string_erase(client->out, 0, written);
+
+    if (client->out->len > GATEWAY_MAX_OUTPUT)
+    {
+        purple_debug_info("toxprpl", "gateway: dropping slow client\n");
+        gateway_client_free(client);
+        return FALSE;
+    }
+
+    if ((client->out->len > 0) && (client->write_handle == 0))
+    {
+        client->write_handle = purple_input_add(client->fd,
+                PURPLE_INPUT_WRITE, gateway_client_write_cb, client);
+    }
+    else if ((client->out->len == 0) && (client->write_handle != 0))
+    {
+        purple_input_remove(client->write_handle);
+        client->write_handle = 0;
+    }
+    return TRUE;
+}
+
+static void gateway_client_write_cb(gpointer data, gint fd,
+                                    PurpleInputCondition cond)
+{
+    gateway_client_flush((gateway_client *)data);
+}
+
+static void gateway_queue(GString *out, const char *event, const char *key,
+                          const char *text)
+{
+    g_string_append(out, event);
+    if (key != NULL)
+    {
+        g_string_append_c(out, ' ');
+        g_string_append(out, key);
+    }
+    if (text != NULL)
+    {
+        g_string_append_c(out, ' ');
+        gateway_append_escaped(out, text);
+    }
+    g_string_append_c(out, '\n');
+}
+
+static void gateway_reply_status(gateway_client *client, int ret)
+{
+    if (ret > 0)
+    {
+        g_string_append_printf(client->out, "OK %d\n", ret);
+    }
+    else if (ret == 0)
+    {
+        g_string_append_len(client->out, "OK\n", 3);
+    }
+    else
+    {
+        g_string_append_printf(client->out, "ERR %d %s\n", -ret,
+                               strerror(-ret));
+    }
+}
+
+static void gateway_process_line(gateway_client *client, char *line)
+{
+    toxprpl_gateway *gateway = client->gateway;
+    char *cmd = line;
+    char *key = NULL;
+    char *text = NULL;
+    int ret = -EINVAL;
+
+    // split into "cmd key text", the text keeps its spaces
+    key = strchr(cmd, ' ');
+    if (key != NULL)
+    {
+        *key++ = '\0';
+        text = strchr(key, ' ');
+        if (text != NULL)
+        {
+            *text++ = '\0';
+            gateway_unescape(text);
+        }
+    }
+
+    gateway->current = client;
+    if (!strcmp(cmd, "SEND") && (key != NULL) && (text != NULL))
+    {
+        ret = gateway->ops.send(key, text);
+    }
+    else if (!strcmp(cmd, "BCAST") && (key != NULL) && (text != NULL))
+    {
+        ret = gateway->ops.broadcast(key, text);
+    }
+    else if (!strcmp(cmd, "ADD") && (key != NULL))
+    {
+        ret = gateway->ops.add(key);
+    }
+    else if (!strcmp(cmd, "DEL") && (key != NULL))
+    {
+        ret = gateway->ops.remove(key);
+    }
+    else if (!strcmp(cmd, "STATUS") && (key != NULL))
+    {
+        ret = gateway->ops.set_status(key, text);
+    }
+    else if (!strcmp(cmd, "FRIENDS"))
+    {
+        ret = gateway->ops.list(gateway);
+    }
+    else if (!strcmp(cmd, "REPLAY") && (key != NULL) && (text != NULL))
+    {
+        ret = gateway->ops.replay(key, text);
+    }
+    else if (!strcmp(cmd, "LANES"))
+    {
+        ret = gateway->ops.lanes(gateway);
+    }
+    else
+    {
+        purple_debug_info("toxprpl", "gateway: unknown command %s\n", cmd);
+    }
+    gateway->current = NULL;
+
+    gateway_reply_status(client, ret);
+}
+
+static void gateway_client_read_cb(gpointer data, gint fd,
+                                   PurpleInputCondition cond)
+{
+    gateway_client *client = (gateway_client *)data;
+    gsize start;
+    gsize pos;
+    int chunks;
+
+    // drain the socket, so a burst of commands is handled in one go
+    for (chunks = 0; chunks < GATEWAY_MAX_READ_CHUNKS; chunks++)
+    {
+        gsize old_len = client->in->len;
+        g_string_set_size(client->in, old_len + GATEWAY_READ_CHUNK);
+        ssize_t ret = read(fd, client->in->str + old_len, GATEWAY_READ_CHUNK);
+        if (ret < 0)
+        {
+            g_string_set_size(client->in, old_len);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            gateway_client_free(client);
+            return;
+        }
+
+        g_string_set_size(client->in, old_len + ret);
+        if (ret == 0)
+        {
+            purple_debug_info("toxprpl", "gateway: client disconnected\n");
+            gateway_client_free(client);
+            return;
+        }
+    }
+
+    start = 0;
+    for (pos = 0; pos < client->in->len; pos++)
+    {
+        if (client->in->str[pos] != '\n')
+        {
+            continue;
+        }
+
+        client->in->str[pos] = '\0';
+        if ((pos > start) && (client->in->str[pos - 1] == '\r'))
+        {
+            client->in->str[pos - 1] = '\0';
+        }
+        if (pos > start)
+        {
+            gateway_process_line(client, client->in->str + start);
+        }
+        start = pos + 1;
+    }
+    g_string_erase(client->in, 0, start);
+
+    if (client->in->len > GATEWAY_MAX_LINE)
+    {
+        purple_debug_info("toxprpl", "gateway: line too long, dropping "
+                          "client\n");
+        gateway_client_free(client);
+        return;
+    }
+
+    gateway_client_flush(client);
+}
+
+static void gateway_accept_cb(gpointer data, gint fd,
+                              PurpleInputCondition cond)
+{
+    toxprpl_gateway *gateway = (toxprpl_gateway *)data;
+
+    for (;;)
+    {
+        int client_fd = accept(fd, NULL, NULL);
+        if (client_fd < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        if (gateway_set_nonblocking(client_fd) < 0)
+        {
+            close(client_fd);
+            continue;
+        }
+
+        gateway_client *client = g_new0(gateway_client, 1);
+        client->gateway = gateway;
+        client->fd = client_fd;
+        client->in = g_string_sized_new(GATEWAY_READ_CHUNK);
+        client->out = g_string_sized_new(GATEWAY_READ_CHUNK);
+        client->read_handle = purple_input_add(client_fd, PURPLE_INPUT_READ,
+                                               gateway_client_read_cb, client);
+        gateway->clients = g_list_prepend(gateway->clients, client);
+        purple_debug_info("toxprpl", "gateway: client connected\n");
+    }
+}
+
+toxprpl_gateway *toxprpl_gateway_new(const char *path,
+                                     const toxprpl_gateway_ops *ops)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        purple_debug_error("toxprpl", "gateway: socket path too long: %s\n",
+                           path);
+        return NULL;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        purple_debug_error("toxprpl", "gateway: socket failed: %s\n",
+                           strerror(errno));
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // a stale socket from a previous run would make bind() fail, but the
+    // option may name any file, only ever replace a socket
+    struct stat st;
+    if (lstat(path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            purple_debug_error("toxprpl", "gateway: %s exists and is not a "
+                               "socket\n", path);
+            close(fd);
+            return NULL;
+        }
+        unlink(path);
+    }
+
+    // the socket must never be reachable by others, not even until chmod()
+    mode_t mask = umask(S_IRWXG | S_IRWXO);
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if ((ret < 0) ||
+        (chmod(path, S_IRUSR | S_IWUSR) < 0) ||
+        (listen(fd, 16) < 0) ||
+        (gateway_set_nonblocking(fd) < 0))
+    {
+        purple_debug_error("toxprpl", "gateway: could not listen on %s: %s\n",
+                           path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    toxprpl_gateway *gateway = g_new0(toxprpl_gateway, 1);
+    gateway->path = g_strdup(path);
+    gateway->fd = fd;
+    gateway->ops = *ops;
+    gateway->accept_handle = purple_input_add(fd, PURPLE_INPUT_READ,
+                                              gateway_accept_cb, gateway);
+    purple_debug_info("toxprpl", "gateway: listening on %s\n", path);
+    return gateway;
+}
+
+void toxprpl_gateway_free(toxprpl_gateway *gateway)
+{
+    if (gateway == NULL)
+    {
+        return;
+    }
+
+    while (gateway->clients != NULL)
+    {
+        gateway_client *client = gateway->clients->data;
+        // last chance to deliver pending events, errors do not matter here
+        if (client->out->len > 0)
+        {
+            ssize_t ret = write(client->fd, client->out->str,
+                                client->out->len);
+            (void)ret;
+        }
+        gateway_client_free(client);
+    }
+
+    purple_input_remove(gateway->accept_handle);
+    close(gateway->fd);
+    unlink(gateway->path);
+    g_free(gateway->path);
+    g_free(gateway);
+}
+
+void toxprpl_gateway_emit(toxprpl_gateway *gateway, const char *event,
+                          const char *key, const char *text)
+{
+    GList *l;
+
+    if (gateway == NULL)
+    {
+        return;
+    }
+
+    for (l = gateway->clients; l != NULL; l = l->next)
+    {
+        gateway_client *client = l->data;
+        gateway_queue(client->out, event, key, text);
+    }
+}
+
+void toxprpl_gateway_reply(toxprpl_gateway *gateway, const char *event,
+                           const char *key, const char *text)
+{
+    if ((gateway == NULL) || (gateway->current == NULL))
+    {
+        return;
+    }
+    gateway_queue(gateway->current->out, event, key, text);
+}
+
+void toxprpl_gateway_flush(toxprpl_gateway *gateway)
+{
+    GList *l;
+
+    if (gateway == NULL)
+    {
+        return;
+    }
+
+    l = gateway->clients;
+    while (l != NULL)
+    {
+        GList *next = l->next;
+        gateway_client *client = l->data;
+        if ((client->out->len > 0) && (client->write_handle == 0))
+        {
+            gateway_client_flush(client);
+        }
+        l = next;
+    }
+}
+
+guint toxprpl_gateway_client_count(toxprpl_gateway *gateway)
+{
+    return (gateway != NULL) ? g_list_length(gateway->clients) : 0;
+}
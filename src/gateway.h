@@ -0,0 +1,105 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOXPRPL_GATEWAY_H__
+#define __TOXPRPL_GATEWAY_H__
+
+#include <glib.h>
+
+/*
+ * Local Unix domain socket API for bots. The protocol is line based, fields
+ * are separated by a single space, the last field may contain spaces.
+ * Backslash, newline and carriage return in text are escaped as \\, \n, \r.
+ *
+ * Commands (client to plugin), each one is answered with "OK" (followed by
+ * a number for BCAST) or "ERR <errno> <reason>" in the order the commands
+ * were received:
+ *
+ *   SEND <key> <text>
+ *   BCAST <key,key,...|*> <text>   answered with the broadcast id
+ *   ADD <key>                      add a friend or accept a friend request,
+ *                                  fails with EINVAL (bad key), EEXIST
+ *                                  (already a buddy), EALREADY (request
+ *                                  already sent), ELOOP (own key) or EIO
+ *   DEL <key>
+ *   STATUS <online|away|busy> [message]
+ *   FRIENDS                        answered with FRIEND lines, then OK
+ *   REPLAY <fast|timed|passes> <trace file>
+ *   LANES                          answered with LANE lines, then OK
+ *
+ * Events (plugin to client):
+ *
+ *   MSG <key> <text>
+ *   REQ <key> <text>
+ *   PRESENCE <key> <status id>
+ *   NICK <key> <name>
+ *   FRIEND <key> <status id> <alias>
+ *   BCAST <id> <key> <delivered|sent|failed> <#delivered> <#queued>
+ *         <#failed> <#sent>        sent: tox took the message but the
+ *                                  peer does not send receipts
+ *   REPLAY <callbacks> <passes> <elapsed> <busy> <avg> <p50> <p99> <max>
+ *          <heap growth> <ok|leak|unchecked>
+ *                                  times in microseconds, growth in bytes,
+ *                                  leak: the heap grew in the second
+ *                                  half of a soak run
+ *   LANE <name> <depth> <bytes> <sent> <dropped> <wait avg> <wait max>
+ *        <oldest>                  outbound lane statistics, times in us
+ *
+ * Input is read in large chunks and all complete lines are processed at
+ * once, output is collected per client and written in one go when
+ * toxprpl_gateway_flush() is called from the messenger loop.
+ */
+
+typedef struct _toxprpl_gateway toxprpl_gateway;
+
+typedef struct
+{
+    // all callbacks return 0 on success or a negative errno value
+    int (*send)(const char *key, const char *text);
+    // keys is a comma separated list or "*", returns the broadcast id
+    int (*broadcast)(const char *keys, const char *text);
+    int (*add)(const char *key);
+    int (*remove)(const char *key);
+    int (*set_status)(const char *status, const char *message);
+    // report all friends with toxprpl_gateway_reply()
+    int (*list)(toxprpl_gateway *gateway);
+    // mode is "fast", "timed" or a number of passes for a soak run
+    int (*replay)(const char *mode, const char *path);
+    // report the outbound lanes with toxprpl_gateway_reply()
+    int (*lanes)(toxprpl_gateway *gateway);
+} toxprpl_gateway_ops;
+
+toxprpl_gateway *toxprpl_gateway_new(const char *path,
+                                     const toxprpl_gateway_ops *ops);
+void toxprpl_gateway_free(toxprpl_gateway *gateway);
+
+/* queue an event for all connected clients, text may be NULL */
+void toxprpl_gateway_emit(toxprpl_gateway *gateway, const char *event,
+                          const char *key, const char *text);
+
+/* queue an event for the client whose command is being processed */
+void toxprpl_gateway_reply(toxprpl_gateway *gateway, const char *event,
+                           const char *key, const char *text);
+
+/* write out whatever was queued for the clients */
+void toxprpl_gateway_flush(toxprpl_gateway *gateway);
+
+guint toxprpl_gateway_client_count(toxprpl_gateway *gateway);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#ifdef HAVE_CONFIG_H
+#include "autoconfig.h"
+#endif
+
+#include <debug.h>
+#include <util.h>
+
+#include "icon.h"
+
+#define ICON_CACHE_DIR  "tox_icons"
+
+void toxprpl_icon_hash(const guint8 *data, gsize length, guint8 *hash)
+{
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    gsize size = TOXPRPL_ICON_HASH_LEN;
+
+    g_checksum_update(checksum, data, length);
+    g_checksum_get_digest(checksum, hash, &size);
+    g_checksum_free(checksum);
+}
+
+void toxprpl_icon_hash_to_string(const guint8 *hash, gchar *str)
+{
+    static const gchar hex[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < TOXPRPL_ICON_HASH_LEN; i++)
+    {
+        str[i * 2] = hex[hash[i] >> 4];
+        str[i * 2 + 1] = hex[hash[i] & 0x0f];
+    }
+    str[TOXPRPL_ICON_HASH_LEN * 2] = '\0';
+}
+
+static gchar *icon_cache_path(const guint8 *hash)
+{
+    gchar name[TOXPRPL_ICON_HASH_STR_LEN];
+    toxprpl_icon_hash_to_string(hash, name);
+    return g_build_filename(purple_user_dir(), ICON_CACHE_DIR, name, NULL);
+}
+
+guint8 *toxprpl_icon_cache_load(const guint8 *hash, gsize *length)
+{
+    gchar *path = icon_cache_path(hash);
+    gchar *data = NULL;
+    guint8 check[TOXPRPL_ICON_HASH_LEN];
+
+    if (!g_file_get_contents(path, &data, length, NULL))
+    {
+        g_free(path);
+        return NULL;
+    }
+
+    // the file name is all we go by, make sure it was not damaged
+    toxprpl_icon_hash((const guint8 *)data, *length, check);
+    if (memcmp(check, hash, TOXPRPL_ICON_HASH_LEN) != 0)
+    {
+        purple_debug_warning("toxprpl", "Ignoring damaged icon %s\n", path);
+        g_free(data);
+        data = NULL;
+    }
+    g_free(path);
+    return (guint8 *)data;
+}
+
+gboolean toxprpl_icon_cache_store(const guint8 *hash, const guint8 *data,
+                                  gsize length)
+{
+    gchar *dir = g_build_filename(purple_user_dir(), ICON_CACHE_DIR, NULL);
+    gchar *path = icon_cache_path(hash);
+    gboolean ret = FALSE;
+
+    if (purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR) == 0)
+    {
+        ret = purple_util_write_data_to_file_absolute(path,
+                (const char *)data, length);
+    }
+    if (!ret)
+    {
+        purple_debug_warning("toxprpl", "Could not store icon %s\n", path);
+    }
+    g_free(path);
+    g_free(dir);
+    return ret;
+}
@@ -0,0 +1,49 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOXPRPL_ICON_H__
+#define __TOXPRPL_ICON_H__
+
+#include <glib.h>
+
+#include "frame.h"
+
+/*
+ * Buddy icons are addressed by the sha256 of their content. Icons received
+ * from peers are kept in purple_user_dir()/tox_icons, one file per hash, so
+ * an icon is only transferred when a buddy switches to one we never saw.
+ */
+
+// hex representation plus terminating NUL
+#define TOXPRPL_ICON_HASH_STR_LEN   (TOXPRPL_ICON_HASH_LEN * 2 + 1)
+
+void toxprpl_icon_hash(const guint8 *data, gsize length, guint8 *hash);
+void toxprpl_icon_hash_to_string(const guint8 *hash, gchar *str);
+
+/*
+ * returns the cached icon (to be freed with g_free) or NULL if it is not in
+ * the cache or the file does not match its hash
+ */
+guint8 *toxprpl_icon_cache_load(const guint8 *hash, gsize *length);
+
+/* data must hash to hash, returns FALSE if the file could not be written */
+gboolean toxprpl_icon_cache_store(const guint8 *hash, const guint8 *data,
+                                  gsize length);
+
+#endif
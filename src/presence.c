@@ -0,0 +1,322 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+
+#include <glib.h>
+
+#ifdef HAVE_CONFIG_H
+#include "autoconfig.h"
+#endif
+
+#include <debug.h>
+#include <util.h>
+
+#include "presence.h"
+
+#define PRESENCE_MAGIC      "TXPS"
+#define PRESENCE_MAGIC_LEN  4
+#define PRESENCE_VERSION    1
+#define PRESENCE_ENTRY_LEN  (TOXPRPL_PRESENCE_KEY_LEN + 4)
+
+struct _toxprpl_presence_cache
+{
+    gchar *path;
+    GHashTable *entries;    // hex key -> toxprpl_presence
+    gboolean dirty;
+};
+
+static void presence_free(gpointer data)
+{
+    toxprpl_presence *presence = (toxprpl_presence *)data;
+    g_free(presence->alias);
+    g_free(presence->message);
+    g_free(presence);
+}
+
+static gchar *presence_key_to_string(const guint8 *bin)
+{
+    static const gchar hex[] = "0123456789abcdef";
+    gchar *key = g_malloc(TOXPRPL_PRESENCE_KEY_LEN * 2 + 1);
+    int i;
+
+    for (i = 0; i < TOXPRPL_PRESENCE_KEY_LEN; i++)
+    {
+        key[i * 2] = hex[bin[i] >> 4];
+        key[i * 2 + 1] = hex[bin[i] & 0x0f];
+    }
+    key[TOXPRPL_PRESENCE_KEY_LEN * 2] = '\0';
+    return key;
+}
+
+static gboolean presence_key_from_string(const char *key, guint8 *bin)
+{
+    int i;
+
+    if (strlen(key) != TOXPRPL_PRESENCE_KEY_LEN * 2)
+    {
+        return FALSE;
+    }
+    for (i = 0; i < TOXPRPL_PRESENCE_KEY_LEN; i++)
+    {
+        int hi = g_ascii_xdigit_value(key[i * 2]);
+        int lo = g_ascii_xdigit_value(key[i * 2 + 1]);
+        if ((hi < 0) || (lo < 0))
+        {
+            return FALSE;
+        }
+        bin[i] = (hi << 4) | lo;
+    }
+    return TRUE;
+}
+
+static void presence_parse(toxprpl_presence_cache *cache, const guint8 *p,
+                           gsize length)
+{
+    const guint8 *end = p + length;
+
+    if ((length < PRESENCE_MAGIC_LEN + 1) ||
+        (memcmp(p, PRESENCE_MAGIC, PRESENCE_MAGIC_LEN) != 0) ||
+        (p[PRESENCE_MAGIC_LEN] != PRESENCE_VERSION))
+    {
+        purple_debug_warning("toxprpl", "Ignoring presence snapshot %s\n",
+                             cache->path);
+        return;
+    }
+    p += PRESENCE_MAGIC_LEN + 1;
+
+    while ((end - p) >= PRESENCE_ENTRY_LEN)
+    {
+        const guint8 *entry = p;
+        guint8 alias_len = entry[TOXPRPL_PRESENCE_KEY_LEN + 1];
+        guint16 message_len = (entry[TOXPRPL_PRESENCE_KEY_LEN + 2] << 8) |
+                              entry[TOXPRPL_PRESENCE_KEY_LEN + 3];
+
+        p += PRESENCE_ENTRY_LEN;
+        if ((gsize)(end - p) < (gsize)alias_len + message_len)
+        {
+            purple_debug_warning("toxprpl", "Presence snapshot %s is "
+                                 "truncated\n", cache->path);
+            break;
+        }
+
+        toxprpl_presence *presence = g_new0(toxprpl_presence, 1);
+        presence->status = entry[TOXPRPL_PRESENCE_KEY_LEN];
+        presence->stale = TRUE;
+        if (alias_len > 0)
+        {
+            presence->alias = g_strndup((const gchar *)p, alias_len);
+        }
+        if (message_len > 0)
+        {
+            presence->message = g_strndup((const gchar *)p + alias_len,
+                                          message_len);
+        }
+        p += alias_len + message_len;
+
+        g_hash_table_replace(cache->entries, presence_key_to_string(entry),
+                             presence);
+    }
+}
+
+toxprpl_presence_cache *toxprpl_presence_load(const char *path)
+{
+    toxprpl_presence_cache *cache = g_new0(toxprpl_presence_cache, 1);
+    gchar *data = NULL;
+    gsize length;
+
+    cache->path = g_strdup(path);
+    cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           presence_free);
+    if ((path != NULL) && g_file_get_contents(path, &data, &length, NULL))
+    {
+        presence_parse(cache, (const guint8 *)data, length);
+        g_free(data);
+    }
+    purple_debug_info("toxprpl", "Loaded presence of %u friends\n",
+                      g_hash_table_size(cache->entries));
+    return cache;
+}
+
+void toxprpl_presence_free(toxprpl_presence_cache *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    g_hash_table_destroy(cache->entries);
+    g_free(cache->path);
+    g_free(cache);
+}
+
+toxprpl_presence *toxprpl_presence_find(toxprpl_presence_cache *cache,
+                                        const char *key)
+{
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    return g_hash_table_lookup(cache->entries, key);
+}
+
+static toxprpl_presence *presence_get(toxprpl_presence_cache *cache,
+                                      const char *key, gboolean *created)
+{
+    toxprpl_presence *presence = g_hash_table_lookup(cache->entries, key);
+
+    *created = (presence == NULL);
+    if (presence == NULL)
+    {
+        presence = g_new0(toxprpl_presence, 1);
+        g_hash_table_insert(cache->entries, g_strdup(key), presence);
+        cache->dirty = TRUE;
+    }
+    return presence;
+}
+
+/* NULL and "" are the same thing */
+static gboolean presence_str_set(gchar **field, const char *value)
+{
+    if ((value != NULL) && (*value == '\0'))
+    {
+        value = NULL;
+    }
+    if (g_strcmp0(*field, value) == 0)
+    {
+        return FALSE;
+    }
+    g_free(*field);
+    *field = g_strdup(value);
+    return TRUE;
+}
+
+gboolean toxprpl_presence_update(toxprpl_presence_cache *cache,
+                                 const char *key, guint8 status,
+                                 const char *message)
+{
+    gboolean changed;
+    toxprpl_presence *presence = presence_get(cache, key, &changed);
+
+    presence->stale = FALSE;
+    if (presence->status != status)
+    {
+        presence->status = status;
+        changed = TRUE;
+    }
+    if (presence_str_set(&presence->message, message))
+    {
+        changed = TRUE;
+    }
+    cache->dirty |= changed;
+    return changed;
+}
+
+gboolean toxprpl_presence_set_alias(toxprpl_presence_cache *cache,
+                                    const char *key, const char *alias)
+{
+    gboolean created;
+    toxprpl_presence *presence = presence_get(cache, key, &created);
+
+    if (!presence_str_set(&presence->alias, alias))
+    {
+        return FALSE;
+    }
+    cache->dirty = TRUE;
+    return TRUE;
+}
+
+void toxprpl_presence_remove(toxprpl_presence_cache *cache, const char *key)
+{
+    if ((cache != NULL) && g_hash_table_remove(cache->entries, key))
+    {
+        cache->dirty = TRUE;
+    }
+}
+
+void toxprpl_presence_foreach_remove(toxprpl_presence_cache *cache,
+                                     GHRFunc func, gpointer data)
+{
+    if (g_hash_table_foreach_remove(cache->entries, func, data) > 0)
+    {
+        cache->dirty = TRUE;
+    }
+}
+
+gboolean toxprpl_presence_save(toxprpl_presence_cache *cache)
+{
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+
+    if ((cache == NULL) || !cache->dirty)
+    {
+        return TRUE;
+    }
+    if (cache->path == NULL)
+    {
+        cache->dirty = FALSE;
+        return TRUE;
+    }
+
+    GByteArray *buf = g_byte_array_sized_new(PRESENCE_MAGIC_LEN + 1 +
+            g_hash_table_size(cache->entries) * (PRESENCE_ENTRY_LEN + 64));
+    guint8 version = PRESENCE_VERSION;
+    g_byte_array_append(buf, (const guint8 *)PRESENCE_MAGIC,
+                        PRESENCE_MAGIC_LEN);
+    g_byte_array_append(buf, &version, 1);
+
+    g_hash_table_iter_init(&iter, cache->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        toxprpl_presence *presence = (toxprpl_presence *)value;
+        guint8 entry[PRESENCE_ENTRY_LEN];
+        gsize alias_len = (presence->alias != NULL) ?
+                          MIN(strlen(presence->alias), G_MAXUINT8) : 0;
+        gsize message_len = (presence->message != NULL) ?
+                            MIN(strlen(presence->message), G_MAXUINT16) : 0;
+
+        if (!presence_key_from_string(key, entry))
+        {
+            continue;
+        }
+        entry[TOXPRPL_PRESENCE_KEY_LEN] = presence->status;
+        entry[TOXPRPL_PRESENCE_KEY_LEN + 1] = alias_len;
+        entry[TOXPRPL_PRESENCE_KEY_LEN + 2] = (message_len >> 8) & 0xff;
+        entry[TOXPRPL_PRESENCE_KEY_LEN + 3] = message_len & 0xff;
+        g_byte_array_append(buf, entry, PRESENCE_ENTRY_LEN);
+        g_byte_array_append(buf, (const guint8 *)presence->alias, alias_len);
+        g_byte_array_append(buf, (const guint8 *)presence->message,
+                            message_len);
+    }
+
+    gboolean ret = purple_util_write_data_to_file_absolute(cache->path,
+            (const char *)buf->data, buf->len);
+    if (ret)
+    {
+        cache->dirty = FALSE;
+    }
+    else
+    {
+        purple_debug_warning("toxprpl", "Could not store presence snapshot "
+                             "%s\n", cache->path);
+    }
+    g_byte_array_free(buf, TRUE);
+    return ret;
+}
@@ -0,0 +1,81 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __TOXPRPL_PRESENCE_H__
+#define __TOXPRPL_PRESENCE_H__
+
+#include <glib.h>
+
+/*
+ * Snapshot of the last known presence, status message and alias of every
+ * friend, kept in purple_user_dir()/tox_presence. It is shown right after
+ * login, before the DHT is connected, and afterwards mirrors what libpurple
+ * displays, so a live update only reaches the UI when it differs.
+ *
+ * File format, all numbers in network byte order:
+ *   "TXPS" | version u8 | entries until the end of the file
+ *   entry: key 32 | status u8 | alias length u8 | message length u16 |
+ *          alias | message
+ */
+
+// binary size of a friend key, keys are passed around in lower case hex
+#define TOXPRPL_PRESENCE_KEY_LEN    32
+
+typedef struct
+{
+    guint8 status;      // index into the status table of the prpl
+    gboolean stale;     // loaded from the snapshot, not confirmed yet
+    gchar *alias;
+    gchar *message;
+} toxprpl_presence;
+
+typedef struct _toxprpl_presence_cache toxprpl_presence_cache;
+
+/*
+ * never returns NULL, a missing or damaged file gives an empty cache. With
+ * a NULL path the cache lives in memory only and is never written
+ */
+toxprpl_presence_cache *toxprpl_presence_load(const char *path);
+void toxprpl_presence_free(toxprpl_presence_cache *cache);
+
+/* cache may be NULL */
+toxprpl_presence *toxprpl_presence_find(toxprpl_presence_cache *cache,
+                                        const char *key);
+
+/*
+ * record the state libpurple is about to show, both return FALSE if it is
+ * the one already shown and there is nothing to tell the UI
+ */
+gboolean toxprpl_presence_update(toxprpl_presence_cache *cache,
+                                 const char *key, guint8 status,
+                                 const char *message);
+gboolean toxprpl_presence_set_alias(toxprpl_presence_cache *cache,
+                                    const char *key, const char *alias);
+
+void toxprpl_presence_remove(toxprpl_presence_cache *cache, const char *key);
+
+/* func gets the key and the toxprpl_presence, returns TRUE to drop it */
+void toxprpl_presence_foreach_remove(toxprpl_presence_cache *cache,
+                                     GHRFunc func, gpointer data);
+
+/* writes the file if anything changed since it was loaded or saved */
+gboolean toxprpl_presence_save(toxprpl_presence_cache *cache);
+
+#endif
@@ -0,0 +1,461 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "frame.h"
+#include "sched.h"
+
+#define SCHED_BUDGET        (16 * 1024) // bytes per tick over all lanes
+#define SCHED_LANE_MAX      4096        // items per lane
+#define SCHED_ITEM_SIZE     TOXPRPL_FRAME_MAX   // payload room of spare items
+#define SCHED_SPARE_MAX     1024        // spare items kept for reuse
+
+// bytes a lane may send per round, never below the size of a tox message
+static const gint sched_quantum[TOXPRPL_LANES] = { 4096, 2048, 1024 };
+
+static const char *sched_lane_names[TOXPRPL_LANES] =
+{
+    "control", "interactive", "bulk"
+};
+
+struct _toxprpl_sched_item
+{
+    GList link;             // link.data points back to the item
+    toxprpl_lane lane;
+    int fnum;
+    gboolean parked;
+    gint64 queued_at;
+    toxprpl_sched_done_func done;
+    gpointer data;
+    guint32 length;
+    guint32 size;           // room for the payload
+    guint8 payload[];
+};
+
+/* everything queued for a friend toxcore refused a message for */
+typedef struct
+{
+    GQueue lanes[TOXPRPL_LANES];
+} sched_parked;
+
+typedef struct
+{
+    GQueue queue;
+    guint depth;            // including parked items
+    gsize bytes;
+    gint deficit;
+    guint64 sent;
+    guint64 dropped;
+    gint64 wait_avg;
+    gint64 wait_max;
+} sched_lane;
+
+struct _toxprpl_sched
+{
+    sched_lane lanes[TOXPRPL_LANES];
+    // fnum -> sched_parked, the items of these friends wait outside of the
+    // lanes until one of them gets through, so they never hold up others
+    GHashTable *parked;
+    // items that were sent or dropped, reused by toxprpl_sched_push() so a
+    // busy connection does not allocate for every message
+    GQueue spare;
+    toxprpl_sched_send_func send;
+};
+
+static void sched_parked_free(gpointer data)
+{
+    sched_parked *parked = (sched_parked *)data;
+    int i;
+
+    for (i = 0; i < TOXPRPL_LANES; i++)
+    {
+        GList *link;
+        while ((link = g_queue_pop_head_link(&parked->lanes[i])) != NULL)
+        {
+            g_free(link->data);
+        }
+    }
+    g_free(parked);
+}
+
+toxprpl_sched *toxprpl_sched_new(toxprpl_sched_send_func send)
+{
+    toxprpl_sched *sched = g_new0(toxprpl_sched, 1);
+    int i;
+
+    for (i = 0; i < TOXPRPL_LANES; i++)
+    {
+        g_queue_init(&sched->lanes[i].queue);
+    }
+    g_queue_init(&sched->spare);
+    sched->parked = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                          NULL, sched_parked_free);
+    sched->send = send;
+    return sched;
+}
+
+static gboolean sched_parked_is_empty(sched_parked *parked)
+{
+    int i;
+    for (i = 0; i < TOXPRPL_LANES; i++)
+    {
+        if (!g_queue_is_empty(&parked->lanes[i]))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void sched_unlink(toxprpl_sched *sched, toxprpl_sched_item *item)
+{
+    sched_lane *lane = &sched->lanes[item->lane];
+
+    if (item->parked)
+    {
+        sched_parked *parked = g_hash_table_lookup(sched->parked,
+                GINT_TO_POINTER(item->fnum));
+        g_queue_unlink(&parked->lanes[item->lane], &item->link);
+        if (sched_parked_is_empty(parked))
+        {
+            g_hash_table_remove(sched->parked, GINT_TO_POINTER(item->fnum));
+        }
+    }
+    else
+    {
+        g_queue_unlink(&lane->queue, &item->link);
+    }
+    lane->depth--;
+    lane->bytes -= item->length;
+}
+
+static void sched_item_release(toxprpl_sched *sched, toxprpl_sched_item *item)
+{
+    if ((item->size == SCHED_ITEM_SIZE) &&
+        (g_queue_get_length(&sched->spare) < SCHED_SPARE_MAX))
+    {
+        g_queue_push_head_link(&sched->spare, &item->link);
+        return;
+    }
+    g_free(item);
+}
+
+void toxprpl_sched_free(toxprpl_sched *sched)
+{
+    GList *link;
+    int i;
+
+    if (sched == NULL)
+    {
+        return;
+    }
+
+    g_hash_table_destroy(sched->parked);
+    for (i = 0; i < TOXPRPL_LANES; i++)
+    {
+        while ((link = g_queue_pop_head_link(&sched->lanes[i].queue)) != NULL)
+        {
+            g_free(link->data);
+        }
+    }
+    while ((link = g_queue_pop_head_link(&sched->spare)) != NULL)
+    {
+        g_free(link->data);
+    }
+    g_free(sched);
+}
+
+toxprpl_sched_item *toxprpl_sched_push(toxprpl_sched *sched,
+                                       toxprpl_lane lane, int fnum,
+                                       const guint8 *data, guint32 length,
+                                       toxprpl_sched_done_func done,
+                                       gpointer user_data)
+{
+    sched_lane *l = &sched->lanes[lane];
+
+    if (l->depth >= SCHED_LANE_MAX)
+    {
+        return NULL;
+    }
+
+    toxprpl_sched_item *item;
+    GList *spare = (length <= SCHED_ITEM_SIZE) ?
+                   g_queue_pop_head_link(&sched->spare) : NULL;
+    if (spare != NULL)
+    {
+        item = spare->data;
+    }
+    else
+    {
+        guint32 size = MAX(length, SCHED_ITEM_SIZE);
+        item = g_malloc(sizeof(toxprpl_sched_item) + size);
+        item->size = size;
+    }
+    memset(&item->link, 0, sizeof(item->link));
+    item->link.data = item;
+    item->lane = lane;
+    item->fnum = fnum;
+    item->queued_at = g_get_monotonic_time();
+    item->done = done;
+    item->data = user_data;
+    item->length = length;
+    memcpy(item->payload, data, length);
+
+    // stay behind what is already waiting for a parked friend
+    sched_parked *parked = g_hash_table_lookup(sched->parked,
+                                               GINT_TO_POINTER(fnum));
+    item->parked = (parked != NULL);
+    g_queue_push_tail_link(item->parked ? &parked->lanes[lane] : &l->queue,
+                           &item->link);
+    l->depth++;
+    l->bytes += length;
+    return item;
+}
+
+gboolean toxprpl_sched_has_room(toxprpl_sched *sched, toxprpl_lane lane,
+                                guint count)
+{
+    return sched->lanes[lane].depth + count <= SCHED_LANE_MAX;
+}
+
+void toxprpl_sched_cancel(toxprpl_sched *sched, toxprpl_sched_item *item)
+{
+    if (item == NULL)
+    {
+        return;
+    }
+    sched_unlink(sched, item);
+    sched_item_release(sched, item);
+}
+
+void toxprpl_sched_drop_friend(toxprpl_sched *sched, int fnum)
+{
+    int i;
+
+    for (i = 0; i < TOXPRPL_LANES; i++)
+    {
+        GList *link = g_queue_peek_head_link(&sched->lanes[i].queue);
+        GQueue dropped = G_QUEUE_INIT;
+
+        while (link != NULL)
+        {
+            GList *next = link->next;
+            toxprpl_sched_item *item = link->data;
+            if (item->fnum == fnum)
+            {
+                sched_unlink(sched, item);
+                g_queue_push_tail_link(&dropped, link);
+            }
+            link = next;
+        }
+
+        sched_parked *parked = g_hash_table_lookup(sched->parked,
+                                                   GINT_TO_POINTER(fnum));
+        while ((parked != NULL) &&
+               ((link = g_queue_peek_head_link(&parked->lanes[i])) != NULL))
+        {
+            // the last one takes the parked entry with it
+            sched_unlink(sched, link->data);
+            g_queue_push_tail_link(&dropped, link);
+            parked = g_hash_table_lookup(sched->parked,
+                                         GINT_TO_POINTER(fnum));
+        }
+
+        while ((link = g_queue_pop_head_link(&dropped)) != NULL)
+        {
+            toxprpl_sched_item *item = link->data;
+            sched->lanes[i].dropped++;
+            if (item->done != NULL)
+            {
+                item->done(item->data, FALSE);
+            }
+            sched_item_release(sched, item);
+        }
+    }
+}
+
+/* takes everything of a friend out of the lanes, keeping the order */
+static void sched_park(toxprpl_sched *sched, int fnum)
+{
+    sched_parked *parked = g_new0(sched_parked, 1);
+    int i;
+
+    for (i = 0; i < TOXPRPL_LANES; i++)
+    {
+        GQueue *queue = &sched->lanes[i].queue;
+        GList *link = g_queue_peek_head_link(queue);
+
+        g_queue_init(&parked->lanes[i]);
+        while (link != NULL)
+        {
+            GList *next = link->next;
+            toxprpl_sched_item *item = link->data;
+            if (item->fnum == fnum)
+            {
+                g_queue_unlink(queue, link);
+                g_queue_push_tail_link(&parked->lanes[i], link);
+                item->parked = TRUE;
+            }
+            link = next;
+        }
+    }
+    g_hash_table_insert(sched->parked, GINT_TO_POINTER(fnum), parked);
+}
+
+/* puts a friend back into the lanes, behind everybody who kept waiting */
+static void sched_unpark(toxprpl_sched *sched, int fnum)
+{
+    sched_parked *parked = g_hash_table_lookup(sched->parked,
+                                               GINT_TO_POINTER(fnum));
+    int i;
+
+    if (parked == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < TOXPRPL_LANES; i++)
+    {
+        GList *link;
+        while ((link = g_queue_pop_head_link(&parked->lanes[i])) != NULL)
+        {
+            ((toxprpl_sched_item *)link->data)->parked = FALSE;
+            g_queue_push_tail_link(&sched->lanes[i].queue, link);
+        }
+    }
+    g_hash_table_remove(sched->parked, GINT_TO_POINTER(fnum));
+}
+
+/* hands an item to toxcore, FALSE if toxcore did not take it */
+static gboolean sched_send(toxprpl_sched *sched, toxprpl_sched_item *item,
+                           gint *budget)
+{
+    sched_lane *lane = &sched->lanes[item->lane];
+
+    if (!sched->send(item->fnum, item->payload, item->length))
+    {
+        return FALSE;
+    }
+
+    gint64 wait = g_get_monotonic_time() - item->queued_at;
+    lane->wait_avg += (wait - lane->wait_avg) / 8;
+    lane->wait_max = MAX(lane->wait_max, wait);
+    lane->sent++;
+    lane->deficit -= item->length;
+    *budget -= item->length;
+
+    sched_unlink(sched, item);
+    if (item->done != NULL)
+    {
+        item->done(item->data, TRUE);
+    }
+    sched_item_release(sched, item);
+    return TRUE;
+}
+
+/* gives every parked friend one try with its most urgent item */
+static void sched_probe(toxprpl_sched *sched, gint *budget)
+{
+    GList *fnums = g_hash_table_get_keys(sched->parked);
+    GList *l;
+
+    for (l = fnums; (l != NULL) && (*budget > 0); l = l->next)
+    {
+        sched_parked *parked = g_hash_table_lookup(sched->parked, l->data);
+        toxprpl_sched_item *item = NULL;
+        int i;
+
+        for (i = 0; (parked != NULL) && (item == NULL) &&
+                    (i < TOXPRPL_LANES); i++)
+        {
+            item = g_queue_peek_head(&parked->lanes[i]);
+        }
+        if ((item != NULL) && sched_send(sched, item, budget))
+        {
+            sched_unpark(sched, GPOINTER_TO_INT(l->data));
+        }
+    }
+    g_list_free(fnums);
+}
+
+void toxprpl_sched_run(toxprpl_sched *sched)
+{
+    gint budget = SCHED_BUDGET;
+    gboolean progress = TRUE;
+    int i;
+
+    sched_probe(sched, &budget);
+
+    while ((budget > 0) && progress)
+    {
+        progress = FALSE;
+        for (i = 0; (i < TOXPRPL_LANES) && (budget > 0); i++)
+        {
+            sched_lane *lane = &sched->lanes[i];
+            toxprpl_sched_item *item;
+
+            if (g_queue_is_empty(&lane->queue))
+            {
+                lane->deficit = 0;
+                continue;
+            }
+
+            lane->deficit += sched_quantum[i];
+            while ((budget > 0) &&
+                   ((item = g_queue_peek_head(&lane->queue)) != NULL) &&
+                   ((gint)item->length <= lane->deficit))
+            {
+                if (sched_send(sched, item, &budget))
+                {
+                    progress = TRUE;
+                }
+                else
+                {
+                    // its later items would have to wait anyway
+                    sched_park(sched, item->fnum);
+                }
+            }
+
+            // a lane which could not spend its share must not hoard it
+            lane->deficit = MIN(lane->deficit, 2 * sched_quantum[i]);
+        }
+    }
+}
+
+void toxprpl_sched_stats(toxprpl_sched *sched, toxprpl_lane lane,
+                         toxprpl_lane_stats *stats)
+{
+    sched_lane *l = &sched->lanes[lane];
+    toxprpl_sched_item *head = g_queue_peek_head(&l->queue);
+
+    stats->depth = l->depth;
+    stats->bytes = l->bytes;
+    stats->sent = l->sent;
+    stats->dropped = l->dropped;
+    stats->wait_avg = l->wait_avg;
+    stats->wait_max = l->wait_max;
+    stats->oldest = (head != NULL) ?
+                    g_get_monotonic_time() - head->queued_at : 0;
+}
+
+const char *toxprpl_lane_name(toxprpl_lane lane)
+{
+    return sched_lane_names[lane];
+}
@@ -0,0 +1,101 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOXPRPL_SCHED_H__
+#define __TOXPRPL_SCHED_H__
+
+#include <glib.h>
+
+/*
+ * Outbound scheduler, everything the plugin sends to toxcore is queued in
+ * one of the lanes below and handed over by toxprpl_sched_run() once per
+ * messenger tick. Lanes are served with deficit round robin, weighted by
+ * bytes, so a large paste or a broadcast only ever gets its share and a
+ * one line reply goes out within the same tick. When toxcore refuses a
+ * message, everything queued for that friend is parked outside of the
+ * lanes and tried once per tick, the friend rejoins the lanes as soon as
+ * one message gets through.
+ */
+
+typedef enum
+{
+    TOXPRPL_LANE_CONTROL = 0,   // hello, acks, presence
+    TOXPRPL_LANE_INTERACTIVE,   // chat messages
+    TOXPRPL_LANE_BULK,          // large pastes, broadcasts, transfers
+    TOXPRPL_LANES
+} toxprpl_lane;
+
+typedef struct _toxprpl_sched toxprpl_sched;
+typedef struct _toxprpl_sched_item toxprpl_sched_item;
+
+/* hands a message to toxcore, returns FALSE if toxcore did not take it */
+typedef gboolean (*toxprpl_sched_send_func)(int fnum, const guint8 *data,
+                                            guint32 length);
+
+/*
+ * called when an item was handed to toxcore (sent is TRUE) or dropped by
+ * toxprpl_sched_drop_friend(). Must not cancel other items.
+ */
+typedef void (*toxprpl_sched_done_func)(gpointer data, gboolean sent);
+
+typedef struct
+{
+    guint depth;
+    gsize bytes;
+    guint64 sent;
+    guint64 dropped;
+    gint64 wait_avg;        // moving average of the queueing delay, in us
+    gint64 wait_max;
+    gint64 oldest;          // age of the item at the head of the lane
+} toxprpl_lane_stats;
+
+toxprpl_sched *toxprpl_sched_new(toxprpl_sched_send_func send);
+
+/* drops everything without calling the done callbacks */
+void toxprpl_sched_free(toxprpl_sched *sched);
+
+/*
+ * queues a copy of data, done may be NULL. Returns NULL if the lane is
+ * full. The item handle is invalid once done was called.
+ */
+toxprpl_sched_item *toxprpl_sched_push(toxprpl_sched *sched,
+                                       toxprpl_lane lane, int fnum,
+                                       const guint8 *data, guint32 length,
+                                       toxprpl_sched_done_func done,
+                                       gpointer user_data);
+
+/* TRUE if count more items fit into the lane, for all or nothing pushes */
+gboolean toxprpl_sched_has_room(toxprpl_sched *sched, toxprpl_lane lane,
+                                guint count);
+
+/* removes a queued item, its done callback is not called */
+void toxprpl_sched_cancel(toxprpl_sched *sched, toxprpl_sched_item *item);
+
+/* drops everything queued for a friend, e.g. when it went offline */
+void toxprpl_sched_drop_friend(toxprpl_sched *sched, int fnum);
+
+/* spends the send budget of one messenger tick */
+void toxprpl_sched_run(toxprpl_sched *sched);
+
+void toxprpl_sched_stats(toxprpl_sched *sched, toxprpl_lane lane,
+                         toxprpl_lane_stats *stats);
+
+const char *toxprpl_lane_name(toxprpl_lane lane);
+
+#endif
@@ -20,6 +20,7 @@
  *  which is disributed under GPL v2 or later.  See http://pidgin.im/
  */
 
+#include <errno.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
@@ -51,6 +52,17 @@
 #include <util.h>
 #include <version.h>
 
+#include "arena.h"
+#include "chat.h"
+#include "compress.h"
+#include "frame.h"
+#include "gateway.h"
+#include "icon.h"
+#include "presence.h"
+#include "sched.h"
+#include "trace.h"
+#include "wheel.h"
+
 #define _(msg) msg // might add gettext later
 
 // TODO: these two things below show be added to a public header of the library
@@ -62,6 +74,49 @@ extern uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
 #define DEFAULT_SERVER_PORT 33445
 #define DEFAULT_SERVER_IP   "192.184.81.118"
 
+// reliable delivery between tox-prpl peers, see toxprpl_friend_schedule()
+#define TOXPRPL_TX_WINDOW           8   // messages in flight per friend
+#define TOXPRPL_TX_QUEUE_MAX        64  // queued + in flight per friend
+#define TOXPRPL_TX_SPARE_MAX        256 // released messages kept for reuse
+#define TOXPRPL_RX_PARTS_MAX        TOXPRPL_TX_QUEUE_MAX    // see rx_parts
+#define TOXPRPL_TX_MAX_ATTEMPTS     6
+#define TOXPRPL_TX_RTO_INITIAL      (3 * G_USEC_PER_SEC)
+#define TOXPRPL_TX_RTO_MAX          (30 * G_USEC_PER_SEC)
+#define TOXPRPL_TX_RETRY_DELAY      100 // ms, when tox did not take a frame
+#define TOXPRPL_ACK_DELAY           50  // ms, acks for a burst are coalesced
+// other clients show a hello as an empty message, so every peer gets one
+// per session and one that never answered none until it sends a frame
+#define TOXPRPL_HELLO_TIMEOUT       10000   // ms
+#define TOXPRPL_SETTING_SILENT      "tox-silent"    // buddy setting
+
+// scheduling, all timers live on g_tox_wheel (milliseconds)
+#define TOXPRPL_WHEEL_RESOLUTION    10
+#define TOXPRPL_MESSENGER_INTERVAL  100
+#define TOXPRPL_CONNECTION_INTERVAL 2000
+#define TOXPRPL_CHECKPOINT_INTERVAL (10 * 60 * 1000)
+#define TOXPRPL_PRESENCE_INTERVAL   (60 * 1000)
+
+// initial size of the per event scratch arena, it grows when needed
+#define TOXPRPL_ARENA_SIZE          (16 * 1024)
+
+// buddy icons, a part of an icon is asked for again when it did not arrive
+#define TOXPRPL_ICON_MAX            10000   // bytes, see icon_spec
+#define TOXPRPL_ICON_TIMEOUT        2000
+#define TOXPRPL_ICON_RETRIES        5
+
+// typing notifications, a state that lasts is repeated at most every
+// TOXPRPL_TYPING_REFRESH seconds and forgotten by the receiver after
+// TOXPRPL_TYPING_EXPIRE ms without a repetition
+#define TOXPRPL_TYPING_REFRESH      5
+#define TOXPRPL_TYPING_EXPIRE       12000
+
+// messages longer than a single tox message are split and sent in the bulk
+// lane, see toxprpl_chunk_length()
+#define TOXPRPL_PLAIN_MAX           (TOXPRPL_FRAME_MAX - 1)
+
+// default pace of broadcasts in messages per second, see toxprpl_broadcast
+#define TOXPRPL_BROADCAST_RATE      20
+
 // todo: allow user to specify a contact request message
 #define DEFAULT_REQUEST_MESSAGE _("Please allow me to add you as a friend!")
 
@@ -70,10 +125,17 @@ static PurplePlugin *g_tox_protocol = NULL;
 // to run multiple instances of the library, so this whole thing is pretty
 // unstable at this point
 static PurpleConnection *g_tox_gc = NULL;
+// all live Tox connections, including the ones that could not log in
+static GList *g_tox_connections = NULL;
 static int g_connected = 0;
-static guint g_tox_messenger_timer = -1;
-static guint g_tox_connection_timer = -1;
+// owns every timer of the connection, freed on close
+static toxprpl_wheel *g_tox_wheel = NULL;
+// scratch memory of the callbacks, reset after every messenger tick
+static toxprpl_arena *g_tox_arena = NULL;
+// everything sent to toxcore goes through here, see sched.h
+static toxprpl_sched *g_tox_sched = NULL;
 static int g_logged_in = 0;
+static gboolean g_tox_initialized = FALSE;
 
 typedef struct
 {
@@ -89,15 +151,139 @@ typedef void (*GcFunc)(PurpleConnection *from,
 
 typedef struct
 {
-    GcFunc fn;
-    PurpleConnection *from;
-    gpointer userdata;
-} GcFuncData;
+    int tox_friendlist_number;
+} toxprpl_buddy_data;
+
+typedef enum
+{
+    TOXPRPL_RCPT_PENDING,       // not handed to tox yet
+    TOXPRPL_RCPT_QUEUED,        // waiting for the receipt
+    TOXPRPL_RCPT_DELIVERED,     // acknowledged by the peer
+    TOXPRPL_RCPT_SENT,          // taken by tox, the peer has no receipts
+    TOXPRPL_RCPT_FAILED
+} toxprpl_rcpt_state;
 
 typedef struct
 {
-    int tox_friendlist_number;
-} toxprpl_buddy_data;
+    int fnum;
+    // copied at the start, the friend may be gone when the state is reported
+    gchar key[CLIENT_ID_SIZE * 2 + 1];
+    toxprpl_rcpt_state state;
+    struct _toxprpl_broadcast *broadcast;
+} toxprpl_broadcast_rcpt;
+
+/*
+ * one message to many friends: the payload is built once and shared by all
+ * recipients, recipients are handed to tox at the configured rate,
+ * interleaved with other running broadcasts.
+ */
+typedef struct _toxprpl_broadcast
+{
+    guint id;
+    GBytes *payload;
+    toxprpl_broadcast_rcpt *rcpts;
+    guint count;
+    guint next;         // next recipient to schedule
+    guint queued;
+    guint delivered;
+    guint sent;
+    guint failed;
+} toxprpl_broadcast;
+
+typedef struct
+{
+    GList link;         // in the tx queue of the friend, data is the message
+    guint32 seq;
+    toxprpl_lane lane;
+    guint8 flags;               // DATA frame flags
+    toxprpl_sched_item *item;   // waiting in the outbound lane
+    gint64 sent_at;     // monotonic time of the last transmission, 0 if none
+    gint64 rto;
+    guint attempts;
+    toxprpl_broadcast *broadcast;   // NULL for regular messages
+    guint rcpt;
+    struct _toxprpl_friend *friend;
+    guint32 first;      // sequence of the first part of a split message
+    GBytes *text;       // whole split message for the failure notice
+    // copies, so queueing a message takes nothing from the heap once there
+    // are spare messages, see toxprpl_tx_msg_new()
+    gsize length;
+    gsize packed_length;    // 0 if compression does not pay off
+    guint8 payload[TOXPRPL_FRAME_DATA_MAX];
+    guint8 packed[TOXPRPL_FRAME_DATA_MAX];
+} toxprpl_tx_msg;
+
+/* part of a split message, waiting for the others */
+typedef struct
+{
+    guint32 seq;
+    guint8 flags;
+    guint16 length;
+    guint8 data[];
+} toxprpl_rx_part;
+
+/* download of a buddy icon, one part after the other */
+typedef struct
+{
+    guint8 hash[TOXPRPL_ICON_HASH_LEN];
+    guint32 size;
+    guint32 offset;     // next part to ask for
+    guint8 *data;
+    guint retries;
+    toxprpl_timer *timer;
+} toxprpl_icon_fetch;
+
+typedef struct _toxprpl_friend
+{
+    int fnum;
+    gchar key[CLIENT_ID_SIZE * 2 + 1];
+    gboolean online;
+    // created by a trace replay, see toxprpl_replay_dispatch(). Its frames
+    // go nowhere and it never shows up in the UI or on the gateway
+    gboolean replay;
+
+    // attribute cache, kept up to date by the tox callbacks so the UI hooks
+    // never need to call into toxcore
+    USERSTATUS userstatus;
+    int status_index;
+    time_t last_seen;
+    gchar name[MAX_NAME_LENGTH + 1];
+    gchar status_message[MAX_STATUSMESSAGE_LENGTH + 1];
+
+    // what we learned from the hello frame of the peer
+    guint32 peer_caps;
+    gboolean hello_sent;
+    gboolean session_ready;
+    // waits for the answer to our hello, NULL once it came or timed out
+    toxprpl_timer *hello_timer;
+
+    // outgoing, unacknowledged messages in sequence order
+    guint32 tx_next;
+    GQueue tx_queue;
+
+    // incoming, duplicate suppression and acknowledgement state
+    gboolean rx_synced;
+    guint32 rx_epoch;
+    guint32 rx_next;
+    guint32 rx_mask;
+    gboolean ack_pending;
+    // parts of split messages in sequence order, see toxprpl_rx_part_add()
+    GQueue rx_parts;
+
+    // next ack or retransmission, NULL if there is nothing to do
+    toxprpl_timer *timer;
+
+    // running buddy icon download, NULL if none
+    toxprpl_icon_fetch *icon_fetch;
+
+    // typing state we last sent and when, the frame while it is queued
+    guint8 tx_typing;
+    gint64 tx_typing_at;
+    toxprpl_sched_item *typing_item;
+    // typing state of the peer as shown, expires on typing_timer
+    guint8 rx_typing;
+    toxprpl_timer *typing_timer;
+} toxprpl_friend;
 
 #define TOXPRPL_MAX_STATUSES    4
 #define TOXPRPL_STATUS_ONLINE     0
@@ -131,6 +317,59 @@ static toxprpl_status toxprpl_statuses[] =
  */
 GHashTable* goffline_messages = NULL;
 
+/*
+ * maps tox friend numbers to toxprpl_friend structures, friends which have
+ * unacknowledged messages or owe an acknowledgement have a timer on the
+ * wheel, so nothing needs to walk the whole friend list. initialized in
+ * toxprpl_tox_init.
+ */
+static GHashTable *g_tox_friends = NULL;
+static guint32 g_tox_epoch = 0;
+
+// a replay runs against friends and send queues of its own, the live ones
+// are only swapped out while a recorded callback is dispatched
+static GHashTable *g_tox_replay_friends = NULL;
+static toxprpl_sched *g_tox_replay_sched = NULL;
+static toxprpl_presence_cache *g_tox_replay_presence = NULL;
+static gboolean g_tox_replaying = FALSE;
+
+// group chats by libpurple chat id and by room
+static GHashTable *g_tox_chats = NULL;
+static GHashTable *g_tox_chat_rooms = NULL;
+static int g_tox_chat_id = 0;
+
+// the last shared payload compressed and the result, broadcasts and chats
+// queue the same payload for many friends
+static GBytes *g_tox_packed_in = NULL;
+static guint8 g_tox_packed_out[TOXPRPL_FRAME_DATA_MAX];
+static gsize g_tox_packed_length = 0;
+
+// released messages, see toxprpl_tx_msg_new()
+static GQueue g_tox_tx_spare = G_QUEUE_INIT;
+
+// what the buddy list shows for every friend, see presence.h
+static toxprpl_presence_cache *g_tox_presence = NULL;
+
+// our own buddy icon, NULL if none is set
+static GBytes *g_tox_icon = NULL;
+static guint8 g_tox_icon_hash[TOXPRPL_ICON_HASH_LEN];
+
+static toxprpl_gateway *g_tox_gateway = NULL;
+static gboolean g_tox_headless = FALSE;
+
+// what we last told toxcore about ourselves, see toxprpl_set_status()
+static int g_tox_self_status_index = -1;
+static gchar *g_tox_self_status_message = NULL;
+
+// see toxprpl_trace_callback() and toxprpl_replay_start()
+static toxprpl_trace *g_tox_trace = NULL;
+static toxprpl_replay *g_tox_replay = NULL;
+
+static GQueue g_tox_broadcasts = G_QUEUE_INIT;
+static guint g_tox_broadcast_id = 0;
+static gdouble g_tox_broadcast_tokens = 0;
+static gint64 g_tox_broadcast_last = 0;
+
 typedef struct
 {
     char *from;
@@ -139,6 +378,7 @@ typedef struct
     PurpleMessageFlags flags;
 } GOfflineMessage;
 
+static int toxprpl_add_friend(const char *buddy_key, gboolean notify);
 static void toxprpl_add_to_buddylist(char *buddy_key);
 static void toxprpl_do_not_add_to_buddylist(char *buddy_key);
 static void foreach_toxprpl_gc(GcFunc fn, PurpleConnection *from,
@@ -147,7 +387,40 @@ static void discover_status(PurpleConnection *from, PurpleConnection *to,
         gpointer userdata);
 static void toxprpl_query_buddy_status(gpointer data, gpointer user_data);
 
-static unsigned char *toxprpl_tox_hex_string_to_id(const char *hex_string);
+static gboolean toxprpl_tox_hex_string_to_id(const char *hex_string,
+                                             uint8_t *bin_id);
+static int toxprpl_send_im(PurpleConnection *gc, const char *who,
+        const char *message, PurpleMessageFlags flags);
+static void toxprpl_remove_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
+        PurpleGroup *group);
+static void toxprpl_broadcast_done(toxprpl_broadcast *broadcast, guint rcpt,
+                                   toxprpl_rcpt_state state);
+static int toxprpl_broadcast_to_buddies(const char *message, gchar **keys);
+static void toxprpl_set_status(PurpleAccount *account, PurpleStatus *status);
+static int toxprpl_replay_start(const char *path, gboolean realtime,
+                                guint passes);
+static void toxprpl_on_chat(toxprpl_friend *friend, const guint8 *data,
+                            guint16 length);
+static void toxprpl_chat_friend_gone(toxprpl_friend *friend);
+static void toxprpl_typing_set(toxprpl_friend *friend, guint8 state);
+
+/* our statuses have one primitive each, -1 if the status is not ours */
+static int toxprpl_status_index(PurpleStatus *status)
+{
+    switch (purple_status_type_get_primitive(purple_status_get_type(status)))
+    {
+        case PURPLE_STATUS_AVAILABLE:
+            return TOXPRPL_STATUS_ONLINE;
+        case PURPLE_STATUS_AWAY:
+            return TOXPRPL_STATUS_AWAY;
+        case PURPLE_STATUS_UNAVAILABLE:
+            return TOXPRPL_STATUS_BUSY;
+        case PURPLE_STATUS_OFFLINE:
+            return TOXPRPL_STATUS_OFFLINE;
+        default:
+            return -1;
+    }
+}
 
 // stay independent from the lib
 static int toxprpl_get_status_index(int fnum, USERSTATUS status)
@@ -173,423 +446,3855 @@ static int toxprpl_get_status_index(int fnum, USERSTATUS status)
 }
 
 /* tox helpers */
-static gchar *toxprpl_tox_bin_id_to_string(uint8_t *bin_id)
+// string_id must have room for CLIENT_ID_SIZE * 2 + 1 characters
+static void toxprpl_tox_bin_id_to_string(const uint8_t *bin_id,
+                                         gchar *string_id)
 {
+    static const gchar hex[] = "0123456789abcdef";
     int i;
-    gchar *string_id = g_malloc(CLIENT_ID_SIZE * 2 + 1);
-    gchar *p = string_id;
+
     for (i = 0; i < CLIENT_ID_SIZE; i++)
     {
-        sprintf(p, "%02x", bin_id[i] & 0xff);
-        p = p + 2;
+        string_id[i * 2] = hex[bin_id[i] >> 4];
+        string_id[i * 2 + 1] = hex[bin_id[i] & 0x0f];
     }
-    p[CLIENT_ID_SIZE * 2] = '\0';
-    return string_id;
+    string_id[CLIENT_ID_SIZE * 2] = '\0';
 }
 
+/* per friend state */
+static toxprpl_sched *toxprpl_friend_sched(toxprpl_friend *friend)
+{
+    return friend->replay ? g_tox_replay_sched : g_tox_sched;
+}
 
-/* tox specific stuff */
-static void on_friendstatus(int fnum, uint8_t status)
+/* the friends the tox callbacks work on */
+static GHashTable *toxprpl_friends(void)
 {
-    if (status == FRIEND_ONLINE)
+    return g_tox_replaying ? g_tox_replay_friends : g_tox_friends;
+}
+
+static toxprpl_tx_msg *toxprpl_tx_msg_new(void)
+{
+    GList *link = g_queue_pop_head_link(&g_tox_tx_spare);
+    toxprpl_tx_msg *msg = (link != NULL) ? link->data :
+                          g_new(toxprpl_tx_msg, 1);
+
+    // the caller fills the buffers
+    memset(msg, 0, G_STRUCT_OFFSET(toxprpl_tx_msg, payload));
+    msg->link.data = msg;
+    return msg;
+}
+
+/* the message must not be in a tx queue any more */
+static void toxprpl_tx_msg_free(toxprpl_tx_msg *msg)
+{
+    toxprpl_sched_cancel(toxprpl_friend_sched(msg->friend), msg->item);
+    if (msg->text != NULL)
+    {
+        g_bytes_unref(msg->text);
+    }
+    if (g_queue_get_length(&g_tox_tx_spare) < TOXPRPL_TX_SPARE_MAX)
+    {
+        g_queue_push_head_link(&g_tox_tx_spare, &msg->link);
+        return;
+    }
+    g_free(msg);
+}
+
+static void toxprpl_icon_fetch_free(toxprpl_friend *friend)
+{
+    toxprpl_icon_fetch *fetch = friend->icon_fetch;
+    if (fetch == NULL)
+    {
+        return;
+    }
+
+    toxprpl_wheel_cancel(g_tox_wheel, fetch->timer);
+    g_free(fetch->data);
+    g_free(fetch);
+    friend->icon_fetch = NULL;
+}
+
+static void toxprpl_rx_parts_clear(toxprpl_friend *friend)
+{
+    toxprpl_rx_part *part;
+    while ((part = g_queue_pop_head(&friend->rx_parts)) != NULL)
+    {
+        g_free(part);
+    }
+}
+
+static void toxprpl_friend_free(gpointer data)
+{
+    toxprpl_friend *friend = (toxprpl_friend *)data;
+    GList *link;
+
+    while ((link = g_queue_pop_head_link(&friend->tx_queue)) != NULL)
     {
-        purple_debug_info("toxprpl", "Friend status change: %d\n", status);
-        uint8_t client_id[CLIENT_ID_SIZE];
-        if (getclient_id(fnum, client_id) < 0)
+        toxprpl_tx_msg *msg = link->data;
+        if (msg->broadcast != NULL)
         {
-            purple_debug_info("toxprpl", "Could not get id of friend #%d\n",
-                              fnum);
-            return;
+            toxprpl_broadcast_done(msg->broadcast, msg->rcpt,
+                                   TOXPRPL_RCPT_FAILED);
         }
+        toxprpl_tx_msg_free(msg);
+    }
+    toxprpl_rx_parts_clear(friend);
+    toxprpl_wheel_cancel(g_tox_wheel, friend->timer);
+    toxprpl_wheel_cancel(g_tox_wheel, friend->hello_timer);
+    toxprpl_wheel_cancel(g_tox_wheel, friend->typing_timer);
+    toxprpl_sched_cancel(toxprpl_friend_sched(friend), friend->typing_item);
+    toxprpl_icon_fetch_free(friend);
+    g_free(friend);
+}
+
+static toxprpl_friend *toxprpl_friend_get(int fnum)
+{
+    toxprpl_friend *friend = g_hash_table_lookup(toxprpl_friends(),
+                                                 GINT_TO_POINTER(fnum));
+    if (friend != NULL)
+    {
+        return friend;
+    }
 
-        gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
-        PurpleAccount *account = purple_connection_get_account(g_tox_gc);
-        purple_prpl_got_user_status(account, buddy_key,
-            toxprpl_statuses[TOXPRPL_STATUS_ONLINE].id, NULL);
-        g_free(buddy_key);
+    uint8_t client_id[CLIENT_ID_SIZE];
+    if (getclient_id(fnum, client_id) < 0)
+    {
+        return NULL;
     }
+
+    friend = g_new0(toxprpl_friend, 1);
+    friend->fnum = fnum;
+    friend->replay = g_tox_replaying;
+    friend->userstatus = USERSTATUS_NONE;
+    friend->status_index = TOXPRPL_STATUS_OFFLINE;
+    toxprpl_tox_bin_id_to_string(client_id, friend->key);
+    g_queue_init(&friend->tx_queue);
+    g_queue_init(&friend->rx_parts);
+    g_hash_table_insert(toxprpl_friends(), GINT_TO_POINTER(fnum), friend);
+    return friend;
 }
 
-static void on_request(uint8_t* public_key, uint8_t* data, uint16_t length)
+/* cache lookup only, never creates an entry or calls into toxcore */
+static toxprpl_friend *toxprpl_friend_find(int fnum)
 {
-    int i;
-    gchar *dialog_message;
+    GHashTable *friends = toxprpl_friends();
+    if (friends == NULL)
+    {
+        return NULL;
+    }
+    return g_hash_table_lookup(friends, GINT_TO_POINTER(fnum));
+}
 
-    if (g_tox_gc == NULL)
+static toxprpl_friend *toxprpl_friend_find_buddy(PurpleBuddy *buddy)
+{
+    toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
+    if (buddy_data == NULL)
     {
-        return;
+        return NULL;
     }
+    return toxprpl_friend_find(buddy_data->tox_friendlist_number);
+}
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
-    if (buddy_key == NULL)
+static void toxprpl_friend_remove(int fnum)
+{
+    toxprpl_friend *friend = toxprpl_friend_find(fnum);
+    if (friend != NULL)
     {
-        purple_notify_error(g_tox_gc, _("Error"),
-                            _("Could not parse public key of a buddy request "),
-                            NULL);
-        return;
+        toxprpl_chat_friend_gone(friend);
+        g_hash_table_remove(toxprpl_friends(), GINT_TO_POINTER(fnum));
     }
-    purple_debug_info("toxprpl", "Buddy request from %s: %s\n",
-                      buddy_key, data);
+    // plain messages and control frames still waiting for this friend
+    toxprpl_sched_drop_friend(g_tox_replaying ? g_tox_replay_sched :
+                              g_tox_sched, fnum);
+}
+
+static int toxprpl_friend_status_index(toxprpl_friend *friend)
+{
+    if (!friend->online)
+    {
+        return TOXPRPL_STATUS_OFFLINE;
+    }
+
+    switch (friend->userstatus)
+    {
+        case USERSTATUS_AWAY:
+            return TOXPRPL_STATUS_AWAY;
+        case USERSTATUS_BUSY:
+            return TOXPRPL_STATUS_BUSY;
+        default:
+            return TOXPRPL_STATUS_ONLINE;
+    }
+}
 
+/* pushes the cached presence of a friend to libpurple and gateway clients */
+static void toxprpl_friend_publish(toxprpl_friend *friend)
+{
     PurpleAccount *account = purple_connection_get_account(g_tox_gc);
-    PurpleBuddy *buddy = purple_find_buddy(account, buddy_key);
-    if (buddy != NULL)
+    const char *status_id;
+
+    friend->status_index = toxprpl_friend_status_index(friend);
+    if (!toxprpl_presence_update(friend->replay ? g_tox_replay_presence :
+                                                  g_tox_presence,
+                                 friend->key, friend->status_index,
+                                 friend->status_message) ||
+        friend->replay)
     {
-        purple_debug_info("toxprpl", "Buddy %s already in buddy list!\n");
-        g_free(buddy_key);
+        // e.g. the snapshot restored at login was right, replays have a
+        // snapshot of their own and never reach the buddy list
         return;
     }
 
-    dialog_message = g_strdup_printf("The user %s sendy you a friend request, "
-                                    "do you want to add him?", buddy_key);
+    status_id = toxprpl_statuses[friend->status_index].id;
+    purple_debug_info("toxprpl", "Setting user status for user %s to %s\n",
+                      friend->key, status_id);
 
-    gchar *request_msg = NULL;
-    if (length > 0)
+    if (friend->status_message[0] != '\0')
     {
-        request_msg = g_strndup(data, length);
+        purple_prpl_got_user_status(account, friend->key, status_id,
+                                    "message", friend->status_message, NULL);
     }
-
-    purple_request_yes_no(g_tox_gc, "New friend request", dialog_message,
-                          request_msg,
-                          PURPLE_DEFAULT_ACTION_NONE,
-                          purple_connection_get_account(g_tox_gc), NULL,
-                          NULL,
-                          buddy_key, // data, will be freed elsewhere
-                          G_CALLBACK(toxprpl_add_to_buddylist),
-                          G_CALLBACK(toxprpl_do_not_add_to_buddylist));
-    g_free(dialog_message);
-    g_free(request_msg);
+    else
+    {
+        purple_prpl_got_user_status(account, friend->key, status_id, NULL);
+    }
+    toxprpl_gateway_emit(g_tox_gateway, "PRESENCE", friend->key, status_id);
 }
 
-static void on_incoming_message(int friendnum, uint8_t* string, uint16_t length)
+/* shows delivery information in an open conversation with the friend */
+static void toxprpl_conv_write_status(toxprpl_friend *friend,
+                                      const char *message,
+                                      PurpleMessageFlags flags)
 {
-    purple_debug_info("toxprpl", "Message received!\n");
-    if (g_tox_gc == NULL)
+    PurpleAccount *account = purple_connection_get_account(g_tox_gc);
+    PurpleConversation *conv = purple_find_conversation_with_account(
+            PURPLE_CONV_TYPE_IM, friend->key, account);
+    if ((conv == NULL) || friend->replay)
     {
         return;
     }
+    purple_conversation_write(conv, NULL, message,
+                              flags | PURPLE_MESSAGE_NO_LOG, time(NULL));
+}
 
-    uint8_t client_id[CLIENT_ID_SIZE];
-    if (getclient_id(friendnum, client_id) < 0)
+/* headless gateway for bots, see gateway.h */
+static gboolean toxprpl_headless(void)
+{
+    return g_tox_headless &&
+           (toxprpl_gateway_client_count(g_tox_gateway) > 0);
+}
+
+/* hands an incoming message to the gateway and/or the conversation */
+static void toxprpl_deliver_im(toxprpl_friend *friend, const char *text)
+{
+    // a message ends whatever the peer was typing
+    toxprpl_typing_set(friend, TOXPRPL_TYPING_NONE);
+    if (friend->replay)
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnum);
+        // a bot would answer replayed messages for real
         return;
     }
+    toxprpl_gateway_emit(g_tox_gateway, "MSG", friend->key, text);
+    if (!toxprpl_headless())
+    {
+        serv_got_im(g_tox_gc, friend->key, text, PURPLE_MESSAGE_RECV,
+                    time(NULL));
+    }
+}
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
-    serv_got_im(g_tox_gc, buddy_key, string, PURPLE_MESSAGE_RECV, time(NULL));
-    g_free(buddy_key);
+static int toxprpl_gateway_send(const char *key, const char *text)
+{
+    int ret = toxprpl_send_im(g_tox_gc, key, text, 0);
+    if (ret == 0)
+    {
+        return -ENOENT;
+    }
+    return (ret < 0) ? ret : 0;
 }
 
-static void on_nick_change(int friendnum, uint8_t* data, uint16_t length)
+static int toxprpl_gateway_broadcast(const char *keys, const char *text)
 {
-    purple_debug_info("toxprpl", "Nick change!\n");
+    gchar **split = NULL;
+    int ret;
 
-    if (g_tox_gc == NULL)
+    if (strcmp(keys, "*"))
     {
-        return;
+        split = g_strsplit(keys, ",", -1);
     }
+    ret = toxprpl_broadcast_to_buddies(text, split);
+    g_strfreev(split);
+    return ret;
+}
 
-    uint8_t client_id[CLIENT_ID_SIZE];
-    if (getclient_id(friendnum, client_id) < 0)
+static int toxprpl_gateway_add(const char *key)
+{
+    PurpleAccount *account = purple_connection_get_account(g_tox_gc);
+    if (strlen(key) != CLIENT_ID_SIZE * 2)
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnum);
-        return;
+        return -EINVAL;
+    }
+    if (purple_find_buddy(account, key) != NULL)
+    {
+        return -EEXIST;
     }
+    // no dialogs, the bot is told what went wrong
+    return toxprpl_add_friend(key, FALSE);
+}
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
+static int toxprpl_gateway_remove(const char *key)
+{
     PurpleAccount *account = purple_connection_get_account(g_tox_gc);
-    PurpleBuddy *buddy = purple_find_buddy(account, buddy_key);
+    PurpleBuddy *buddy = purple_find_buddy(account, key);
     if (buddy == NULL)
     {
-        purple_debug_info("toxprpl", "Ignoring nick change because buddy %s was not found\n", buddy_key);
-        g_free(buddy_key);
-        return;
+        return -ENOENT;
     }
-
-    g_free(buddy_key);
-    purple_blist_alias_buddy(buddy, data);
+    toxprpl_remove_buddy(g_tox_gc, buddy, NULL);
+    purple_blist_remove_buddy(buddy);
+    return 0;
 }
 
-static void on_status_change(int friendnum, USERSTATUS userstatus)
+static int toxprpl_gateway_set_status(const char *status, const char *message)
 {
     int i;
-    purple_debug_info("toxprpl", "Status change: %d\n", userstatus);
-    uint8_t client_id[CLIENT_ID_SIZE];
-    if (getclient_id(friendnum, client_id) < 0)
+    PurpleAccount *account = purple_connection_get_account(g_tox_gc);
+
+    for (i = 0; i < TOXPRPL_MAX_STATUSES; i++)
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnum);
-        return;
+        const char *id = toxprpl_statuses[i].id;
+        // accept "tox_away" as well as "away"
+        if (strcmp(status, id) && strcmp(status, id + strlen("tox_")))
+        {
+            continue;
+        }
+
+        if (message != NULL)
+        {
+            purple_account_set_status(account, id, TRUE, "message", message,
+                                      NULL);
+        }
+        else
+        {
+            purple_account_set_status(account, id, TRUE, NULL);
+        }
+        return 0;
     }
+    return -EINVAL;
+}
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
+static int toxprpl_gateway_list(toxprpl_gateway *gateway)
+{
+    GSList *l;
     PurpleAccount *account = purple_connection_get_account(g_tox_gc);
-    purple_debug_info("toxprpl", "Setting user status for user %s to %s\n",
-        buddy_key, toxprpl_statuses[toxprpl_get_status_index(friendnum, userstatus)].id);
-    purple_prpl_got_user_status(account, buddy_key,
-        toxprpl_statuses[toxprpl_get_status_index(friendnum, userstatus)].id,
-        NULL);
-    g_free(buddy_key);
+    GSList *buddy_list = purple_find_buddies(account, NULL);
+
+    for (l = buddy_list; l != NULL; l = l->next)
+    {
+        PurpleBuddy *buddy = (PurpleBuddy *)l->data;
+        PurpleStatus *status = purple_presence_get_active_status(
+                purple_buddy_get_presence(buddy));
+        gchar *text = g_strdup_printf("%s %s", purple_status_get_id(status),
+                                      purple_buddy_get_alias(buddy));
+        toxprpl_gateway_reply(gateway, "FRIEND", buddy->name, text);
+        g_free(text);
+    }
+    g_slist_free(buddy_list);
+    return 0;
 }
 
-static gboolean tox_messenger_loop(gpointer data)
+static int toxprpl_gateway_replay(const char *mode, const char *path)
 {
-    doMessenger();
-    return TRUE;
+    if (!strcmp(mode, "fast"))
+    {
+        return toxprpl_replay_start(path, FALSE, 1);
+    }
+    if (!strcmp(mode, "timed"))
+    {
+        return toxprpl_replay_start(path, TRUE, 1);
+    }
+
+    // a number of passes, run as fast as possible
+    gchar *end;
+    guint64 passes = g_ascii_strtoull(mode, &end, 10);
+    if ((*end != '\0') || (passes == 0) || (passes > G_MAXUINT))
+    {
+        return -EINVAL;
+    }
+    return toxprpl_replay_start(path, FALSE, (guint)passes);
 }
 
-static gboolean tox_connection_check(gpointer gc)
+static int toxprpl_gateway_lanes(toxprpl_gateway *gateway)
 {
-    if ((g_connected == 0) && DHT_isconnected())
+    toxprpl_lane lane;
+
+    for (lane = 0; lane < TOXPRPL_LANES; lane++)
     {
-        g_connected = 1;
-        purple_connection_update_progress(gc, _("Connected"),
-                1,   /* which connection step this is */
-                2);  /* total number of steps */
-        purple_connection_set_state(gc, PURPLE_CONNECTED);
-        purple_debug_info("toxprpl", "DHT connected!\n");
+        toxprpl_lane_stats stats;
+        toxprpl_sched_stats(g_tox_sched, lane, &stats);
+        gchar *text = g_strdup_printf("%u %" G_GSIZE_FORMAT " %" G_GUINT64_FORMAT
+                " %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+                " %" G_GINT64_FORMAT, stats.depth, stats.bytes, stats.sent,
+                stats.dropped, stats.wait_avg, stats.wait_max, stats.oldest);
+        toxprpl_gateway_reply(gateway, "LANE", toxprpl_lane_name(lane), text);
+        g_free(text);
+    }
+    return 0;
+}
 
-        char id[32*2 + 1] = {0};
-        size_t i;
+static const toxprpl_gateway_ops toxprpl_gateway_callbacks =
+{
+    toxprpl_gateway_send,
+    toxprpl_gateway_broadcast,
+    toxprpl_gateway_add,
+    toxprpl_gateway_remove,
+    toxprpl_gateway_set_status,
+    toxprpl_gateway_list,
+    toxprpl_gateway_replay,
+    toxprpl_gateway_lanes
+};
 
-        for(i=0; i<32; i++)
-        {
-            char xx[3];
-            snprintf(xx, sizeof(xx), "%02x",  self_public_key[i] & 0xff);
-            strcat(id, xx);
-        }
-        purple_debug_info("toxprpl", "My ID: %s\n", id);
+/* outbound lanes */
+static gboolean toxprpl_sched_transmit(int fnum, const guint8 *data,
+                                       guint32 length)
+{
+    return m_sendmessage(fnum, (uint8_t *)data, length) != 0;
+}
 
-        // query status of all buddies
-        PurpleAccount *account = purple_connection_get_account(gc);
-        GSList *buddy_list = purple_find_buddies(account, NULL);
-        g_slist_foreach(buddy_list, toxprpl_query_buddy_status, gc);
-        g_slist_free(buddy_list);
+/* the peers of a replay are not there, what they are sent is dropped */
+static gboolean toxprpl_replay_transmit(int fnum, const guint8 *data,
+                                        guint32 length)
+{
+    return TRUE;
+}
+
+/* largest prefix of at most max bytes that does not split a character */
+static gsize toxprpl_chunk_length(const char *text, gsize length, gsize max)
+{
+    gsize cut = max;
+
+    if (length <= max)
+    {
+        return length;
+    }
+    while ((cut > 0) && (((guchar)text[cut] & 0xc0) == 0x80))
+    {
+        cut--;
+    }
+    return (cut > 0) ? cut : max;
+}
+
+/*
+ * plain tox message for peers without receipts, long messages are split
+ * into several tox messages. Returns 1 if queued, negative errno otherwise.
+ */
+static int toxprpl_send_plain(int fnum, const char *message,
+                              toxprpl_sched_done_func done, gpointer data)
+{
+    gsize length = strlen(message);
+    toxprpl_lane lane = (length > TOXPRPL_PLAIN_MAX) ?
+                        TOXPRPL_LANE_BULK : TOXPRPL_LANE_INTERACTIVE;
+    guint8 buf[TOXPRPL_PLAIN_MAX + 1];
+    const char *p = message;
+    gsize left = length;
+    guint parts = 0;
+
+    // all or nothing, the peer can not tell a truncated message
+    do
+    {
+        gsize n = toxprpl_chunk_length(p, left, TOXPRPL_PLAIN_MAX);
+        p += n;
+        left -= n;
+        parts++;
+    } while (left > 0);
+    if (!toxprpl_sched_has_room(g_tox_sched, lane, parts))
+    {
+        purple_debug_info("toxprpl", "Outbound %s lane is full\n",
+                          toxprpl_lane_name(lane));
+        return -ENOBUFS;
+    }
+
+    do
+    {
+        gsize n = toxprpl_chunk_length(message, length, TOXPRPL_PLAIN_MAX);
+        memcpy(buf, message, n);
+        buf[n] = '\0';
+        message += n;
+        length -= n;
+
+        // done only reports the last part, the room was checked above
+        toxprpl_sched_push(g_tox_sched, lane, fnum, buf, n + 1,
+                           (length == 0) ? done : NULL, data);
+    } while (length > 0);
+    return 1;
+}
+
+/* reliable delivery between tox-prpl peers */
+static toxprpl_sched_item *toxprpl_send_frame(toxprpl_friend *friend,
+                                              toxprpl_lane lane,
+                                              const toxprpl_frame *frame,
+                                              toxprpl_sched_done_func done,
+                                              gpointer data)
+{
+    guint8 buf[TOXPRPL_FRAME_MAX];
+    guint32 length = toxprpl_frame_encode(frame, buf, sizeof(buf));
+    if (length == 0)
+    {
+        purple_debug_error("toxprpl", "Could not encode frame of type %d\n",
+                           frame->type);
+        return NULL;
+    }
+    return toxprpl_sched_push(toxprpl_friend_sched(friend), lane,
+                              friend->fnum, buf, length, done, data);
+}
+
+static guint32 toxprpl_tx_base(toxprpl_friend *friend)
+{
+    toxprpl_tx_msg *head = g_queue_peek_head(&friend->tx_queue);
+    return (head != NULL) ? head->seq : friend->tx_next;
+}
+
+static void toxprpl_send_hello(toxprpl_friend *friend)
+{
+    toxprpl_frame frame;
+    frame.type = TOXPRPL_FRAME_HELLO;
+    frame.u.hello.caps = TOXPRPL_CAP_RECEIPTS | TOXPRPL_CAP_ICONS |
+                         TOXPRPL_CAP_CHAT | TOXPRPL_CAP_TYPING;
+    if (toxprpl_compress_available())
+    {
+        frame.u.hello.caps |= TOXPRPL_CAP_LZ4;
+    }
+    frame.u.hello.epoch = g_tox_epoch;
+    frame.u.hello.tx_base = toxprpl_tx_base(friend);
+    if (toxprpl_send_frame(friend, TOXPRPL_LANE_CONTROL, &frame,
+                           NULL, NULL) != NULL)
+    {
+        friend->hello_sent = TRUE;
+    }
+}
+
+/* the buddy of a friend, NULL for replayed friends which have none */
+static PurpleBuddy *toxprpl_friend_buddy(toxprpl_friend *friend)
+{
+    if (friend->replay)
+    {
+        return NULL;
+    }
+    return purple_find_buddy(purple_connection_get_account(g_tox_gc),
+                             friend->key);
+}
+
+/* TRUE if the peer left our last hello unanswered */
+static gboolean toxprpl_friend_silent(toxprpl_friend *friend)
+{
+    PurpleBuddy *buddy = toxprpl_friend_buddy(friend);
+    return (buddy != NULL) &&
+           purple_blist_node_get_bool(PURPLE_BLIST_NODE(buddy),
+                                      TOXPRPL_SETTING_SILENT);
+}
+
+static void toxprpl_friend_set_silent(toxprpl_friend *friend,
+                                      gboolean silent)
+{
+    PurpleBuddy *buddy = toxprpl_friend_buddy(friend);
+    if (buddy == NULL)
+    {
+        return;
+    }
+    if (silent)
+    {
+        purple_blist_node_set_bool(PURPLE_BLIST_NODE(buddy),
+                                   TOXPRPL_SETTING_SILENT, TRUE);
+    }
+    else
+    {
+        purple_blist_node_remove_setting(PURPLE_BLIST_NODE(buddy),
+                                         TOXPRPL_SETTING_SILENT);
+    }
+}
+
+static gboolean toxprpl_hello_timer(gpointer data);
+
+/* one hello per session, unless the peer never answered one */
+static void toxprpl_hello_probe(toxprpl_friend *friend)
+{
+    if (toxprpl_friend_silent(friend))
+    {
+        return;
+    }
+    toxprpl_send_hello(friend);
+    friend->hello_timer = toxprpl_wheel_add(g_tox_wheel,
+            TOXPRPL_HELLO_TIMEOUT, 0, toxprpl_hello_timer, friend);
+}
+
+static gboolean toxprpl_hello_timer(gpointer data)
+{
+    toxprpl_friend *friend = (toxprpl_friend *)data;
+
+    // one-shot, the handle is gone once we return
+    friend->hello_timer = NULL;
+    if (friend->session_ready || !friend->online)
+    {
+        return FALSE;
+    }
+
+    // a tox-prpl peer greets us on its own, see toxprpl_on_frame()
+    purple_debug_info("toxprpl", "No hello from %s, not a tox-prpl peer\n",
+                      friend->key);
+    toxprpl_friend_set_silent(friend, TRUE);
+    return FALSE;
+}
+
+static void toxprpl_send_ack(toxprpl_friend *friend)
+{
+    toxprpl_frame frame;
+    frame.type = TOXPRPL_FRAME_ACK;
+    frame.u.ack.next = friend->rx_next;
+    frame.u.ack.mask = friend->rx_mask;
+    if (toxprpl_send_frame(friend, TOXPRPL_LANE_CONTROL, &frame,
+                           NULL, NULL) != NULL)
+    {
+        friend->ack_pending = FALSE;
+    }
+}
+
+static void toxprpl_friend_schedule(toxprpl_friend *friend);
+
+/* the scheduler handed the frame to tox (or dropped it) */
+static void toxprpl_tx_sent(gpointer data, gboolean sent)
+{
+    toxprpl_tx_msg *msg = (toxprpl_tx_msg *)data;
+
+    msg->item = NULL;
+    if (!sent)
+    {
+        return;
+    }
+
+    // the retransmission timeout starts when it really left
+    msg->sent_at = g_get_monotonic_time();
+    msg->attempts++;
+    toxprpl_friend_schedule(msg->friend);
+}
+
+static gboolean toxprpl_tx_transmit(toxprpl_friend *friend,
+                                    toxprpl_tx_msg *msg)
+{
+    toxprpl_frame frame;
+
+    frame.type = TOXPRPL_FRAME_DATA;
+    frame.u.data.seq = msg->seq;
+    frame.u.data.flags = msg->flags;
+    frame.u.data.payload = msg->payload;
+    frame.u.data.length = msg->length;
+    // the peer may have come back with a client that can not decompress
+    if ((msg->packed_length > 0) && (friend->peer_caps & TOXPRPL_CAP_LZ4))
+    {
+        frame.u.data.payload = msg->packed;
+        frame.u.data.length = msg->packed_length;
+        frame.u.data.flags |= TOXPRPL_DATA_LZ4;
+    }
+
+    msg->item = toxprpl_send_frame(friend, msg->lane, &frame,
+                                   toxprpl_tx_sent, msg);
+    // a full lane is retried later, see toxprpl_friend_schedule()
+    return msg->item != NULL;
+}
+
+static void toxprpl_tx_fail(toxprpl_friend *friend, toxprpl_tx_msg *msg)
+{
+    gsize length = msg->length;
+    const gchar *text = (const gchar *)msg->payload;
+    if (msg->text != NULL)
+    {
+        text = g_bytes_get_data(msg->text, &length);
+    }
+    gchar *notice = toxprpl_arena_printf(g_tox_arena,
+            _("Message could not be delivered: %.*s"), (int)length, text);
+    purple_debug_info("toxprpl", "Giving up on message %u to %s\n",
+                      msg->seq, friend->key);
+    toxprpl_conv_write_status(friend, notice, PURPLE_MESSAGE_ERROR);
+}
+
+/* TRUE if link holds a part of the same message as msg */
+static gboolean toxprpl_tx_same_message(GList *link, toxprpl_tx_msg *msg)
+{
+    return (link != NULL) &&
+           (((toxprpl_tx_msg *)link->data)->first == msg->first);
+}
+
+/*
+ * removes all queued parts of the message at link, which are of no use on
+ * their own. Returns the link following them
+ */
+static GList *toxprpl_tx_drop_message(toxprpl_friend *friend, GList *link)
+{
+    toxprpl_tx_msg *msg = link->data;
+    guint32 first = msg->first;
+
+    // parts are queued back to back
+    while (toxprpl_tx_same_message(link->prev, msg))
+    {
+        link = link->prev;
+    }
+    while ((link != NULL) &&
+           (((toxprpl_tx_msg *)link->data)->first == first))
+    {
+        GList *next = link->next;
+        g_queue_unlink(&friend->tx_queue, link);
+        toxprpl_tx_msg_free(link->data);
+        link = next;
+    }
+    return link;
+}
+
+static gboolean toxprpl_friend_timer(gpointer data);
+
+/*
+ * arms the friend timer for the earliest of: the pending ack, the next
+ * retransmission in the window or a retry of a frame tox did not take
+ */
+static void toxprpl_friend_schedule(toxprpl_friend *friend)
+{
+    gint64 delay = -1;
+
+    if (friend->ack_pending && friend->online)
+    {
+        delay = TOXPRPL_ACK_DELAY;
+    }
+
+    if (friend->online && friend->session_ready)
+    {
+        gint64 now = g_get_monotonic_time();
+        GList *l;
+
+        for (l = g_queue_peek_head_link(&friend->tx_queue); l; l = l->next)
+        {
+            toxprpl_tx_msg *msg = l->data;
+            gint64 due;
+
+            if ((msg->seq - toxprpl_tx_base(friend)) >= TOXPRPL_TX_WINDOW)
+            {
+                break;
+            }
+
+            if (msg->item != NULL)
+            {
+                // toxprpl_tx_sent() schedules it once it left the lane
+                continue;
+            }
+
+            if (msg->sent_at == 0)
+            {
+                due = TOXPRPL_TX_RETRY_DELAY;
+            }
+            else
+            {
+                due = MAX(msg->sent_at + msg->rto - now, 0) / 1000;
+            }
+            delay = (delay < 0) ? due : MIN(delay, due);
+        }
+    }
+
+    if (delay < 0)
+    {
+        toxprpl_wheel_cancel(g_tox_wheel, friend->timer);
+        friend->timer = NULL;
+    }
+    else if (friend->timer == NULL)
+    {
+        friend->timer = toxprpl_wheel_add(g_tox_wheel, delay, 0,
+                                          toxprpl_friend_timer, friend);
+    }
+    else if (toxprpl_wheel_remaining(g_tox_wheel, friend->timer) > delay)
+    {
+        // only ever move it closer, so a steady stream of messages can not
+        // postpone the ack forever
+        toxprpl_wheel_reschedule(g_tox_wheel, friend->timer, delay);
+    }
+}
+
+/* (re)transmits everything in the window which is due */
+static void toxprpl_tx_pump(toxprpl_friend *friend, gint64 now)
+{
+    if (!friend->online || !friend->session_ready)
+    {
+        return;
+    }
+
+    GList *l = g_queue_peek_head_link(&friend->tx_queue);
+    while (l != NULL)
+    {
+        GList *next = l->next;
+        toxprpl_tx_msg *msg = l->data;
+
+        if ((msg->seq - toxprpl_tx_base(friend)) >= TOXPRPL_TX_WINDOW)
+        {
+            break;
+        }
+
+        if ((msg->item == NULL) && (msg->flags & TOXPRPL_DATA_LZ4) &&
+            !(friend->peer_caps & TOXPRPL_CAP_LZ4))
+        {
+            // compressed as a whole, but the peer came back without lz4
+            toxprpl_tx_fail(friend, msg);
+            l = toxprpl_tx_drop_message(friend, l);
+            continue;
+        }
+
+        if (msg->item != NULL)
+        {
+            // still waiting in its outbound lane
+        }
+        else if (msg->sent_at == 0)
+        {
+            msg->rto = TOXPRPL_TX_RTO_INITIAL;
+            if (!toxprpl_tx_transmit(friend, msg))
+            {
+                break;
+            }
+        }
+        else if ((now - msg->sent_at) >= msg->rto)
+        {
+            if (msg->attempts >= TOXPRPL_TX_MAX_ATTEMPTS)
+            {
+                if (msg->broadcast != NULL)
+                {
+                    toxprpl_broadcast_done(msg->broadcast, msg->rcpt,
+                                           TOXPRPL_RCPT_FAILED);
+                }
+                else
+                {
+                    toxprpl_tx_fail(friend, msg);
+                }
+                l = toxprpl_tx_drop_message(friend, l);
+                continue;
+            }
+            else
+            {
+                msg->rto = MIN(msg->rto * 2, TOXPRPL_TX_RTO_MAX);
+                if (!toxprpl_tx_transmit(friend, msg))
+                {
+                    break;
+                }
+            }
+        }
+        l = next;
+    }
+    toxprpl_friend_schedule(friend);
+}
+
+static gboolean toxprpl_friend_timer(gpointer data)
+{
+    toxprpl_friend *friend = (toxprpl_friend *)data;
+
+    // one-shot, the handle is gone once we return
+    friend->timer = NULL;
+
+    if (friend->ack_pending && friend->online)
+    {
+        toxprpl_send_ack(friend);
+    }
+    toxprpl_tx_pump(friend, g_get_monotonic_time());
+    toxprpl_friend_schedule(friend);
+    return FALSE;
+}
+
+static void toxprpl_on_ack(toxprpl_friend *friend, guint32 next, guint32 mask)
+{
+    guint delivered = 0;
+    guint acked = 0;
+    GList *l = g_queue_peek_head_link(&friend->tx_queue);
+
+    while (l != NULL)
+    {
+        GList *lnext = l->next;
+        toxprpl_tx_msg *msg = l->data;
+        gint32 d = (gint32)(msg->seq - next);
+
+        if ((d < 0) || ((d < 32) && (mask & (1u << d))))
+        {
+            // a split message counts once its last remaining part arrived
+            gboolean complete = !toxprpl_tx_same_message(l->prev, msg) &&
+                                !toxprpl_tx_same_message(lnext, msg);
+            g_queue_unlink(&friend->tx_queue, l);
+            if (msg->broadcast != NULL)
+            {
+                toxprpl_broadcast_done(msg->broadcast, msg->rcpt,
+                                       TOXPRPL_RCPT_DELIVERED);
+                acked++;
+            }
+            else if (complete)
+            {
+                delivered++;
+            }
+            toxprpl_tx_msg_free(msg);
+        }
+        l = lnext;
+    }
+
+    if (acked > 0)
+    {
+        toxprpl_tx_pump(friend, g_get_monotonic_time());
+    }
+
+    // broadcasts are not part of the conversation, so no notice for them
+    if (delivered == 0)
+    {
+        return;
+    }
+
+    purple_debug_info("toxprpl", "%u message(s) to %s acknowledged\n",
+                      delivered, friend->key);
+    if (delivered == 1)
+    {
+        toxprpl_conv_write_status(friend, _("Delivered"),
+                                  PURPLE_MESSAGE_SYSTEM);
+    }
+    else
+    {
+        gchar *notice = toxprpl_arena_printf(g_tox_arena,
+                _("%u messages delivered"), delivered);
+        toxprpl_conv_write_status(friend, notice, PURPLE_MESSAGE_SYSTEM);
+    }
+
+    // the window moved, send whatever became eligible
+    toxprpl_tx_pump(friend, g_get_monotonic_time());
+}
+
+/* buddy icons */
+static void toxprpl_icon_announce(toxprpl_friend *friend)
+{
+    static const guint8 none[TOXPRPL_ICON_HASH_LEN];
+    toxprpl_frame frame;
+
+    frame.type = TOXPRPL_FRAME_ICON;
+    frame.u.icon.hash = (g_tox_icon != NULL) ? g_tox_icon_hash : none;
+    frame.u.icon.offset = 0;
+    frame.u.icon.size = (g_tox_icon != NULL) ? g_bytes_get_size(g_tox_icon) : 0;
+    toxprpl_send_frame(friend, TOXPRPL_LANE_CONTROL, &frame, NULL, NULL);
+}
+
+static gboolean toxprpl_icon_timer(gpointer data);
+
+/* asks for the next part and arms the timeout */
+static void toxprpl_icon_request(toxprpl_friend *friend)
+{
+    toxprpl_icon_fetch *fetch = friend->icon_fetch;
+    toxprpl_frame frame;
+
+    frame.type = TOXPRPL_FRAME_ICON_GET;
+    frame.u.icon.hash = fetch->hash;
+    frame.u.icon.offset = fetch->offset;
+    frame.u.icon.size = fetch->size;
+    toxprpl_send_frame(friend, TOXPRPL_LANE_CONTROL, &frame, NULL, NULL);
+
+    if (fetch->timer == NULL)
+    {
+        fetch->timer = toxprpl_wheel_add(g_tox_wheel, TOXPRPL_ICON_TIMEOUT, 0,
+                                         toxprpl_icon_timer, friend);
+    }
+    else
+    {
+        toxprpl_wheel_reschedule(g_tox_wheel, fetch->timer,
+                                 TOXPRPL_ICON_TIMEOUT);
+    }
+}
+
+static gboolean toxprpl_icon_timer(gpointer data)
+{
+    toxprpl_friend *friend = (toxprpl_friend *)data;
+    toxprpl_icon_fetch *fetch = friend->icon_fetch;
+
+    // one-shot, the handle is gone once we return
+    fetch->timer = NULL;
+
+    if (++fetch->retries > TOXPRPL_ICON_RETRIES)
+    {
+        purple_debug_info("toxprpl", "Giving up on the icon of %s\n",
+                          friend->key);
+        toxprpl_icon_fetch_free(friend);
+        return FALSE;
+    }
+    toxprpl_icon_request(friend);
+    return FALSE;
+}
+
+/* hands the icon to libpurple, which takes over data */
+static void toxprpl_icon_apply(toxprpl_friend *friend, const guint8 *hash,
+                               guint8 *data, gsize length)
+{
+    PurpleAccount *account = purple_connection_get_account(g_tox_gc);
+    gchar checksum[TOXPRPL_ICON_HASH_STR_LEN];
+
+    if (friend->replay)
+    {
+        return;
+    }
+    toxprpl_icon_hash_to_string(hash, checksum);
+    purple_buddy_icons_set_for_user(account, friend->key, data, length,
+                                    checksum);
+}
+
+/* the peer told us which icon it uses, fetch it unless we know it */
+static void toxprpl_on_icon(toxprpl_friend *friend, const guint8 *hash,
+                            guint32 size)
+{
+    PurpleAccount *account = purple_connection_get_account(g_tox_gc);
+    PurpleBuddy *buddy = purple_find_buddy(account, friend->key);
+    gchar checksum[TOXPRPL_ICON_HASH_STR_LEN];
+    const char *current;
+    guint8 *data;
+    gsize length;
+
+    if (buddy == NULL)
+    {
+        return;
+    }
+
+    current = purple_buddy_icons_get_checksum_for_user(buddy);
+    if (size == 0)
+    {
+        toxprpl_icon_fetch_free(friend);
+        if (current != NULL)
+        {
+            purple_buddy_icons_set_for_user(account, friend->key, NULL, 0,
+                                            NULL);
+        }
+        return;
+    }
+
+    toxprpl_icon_hash_to_string(hash, checksum);
+    if ((current != NULL) && !strcmp(current, checksum))
+    {
+        // the usual case on every reconnect
+        toxprpl_icon_fetch_free(friend);
+        return;
+    }
+
+    if ((friend->icon_fetch != NULL) &&
+        !memcmp(friend->icon_fetch->hash, hash, TOXPRPL_ICON_HASH_LEN))
+    {
+        return;
+    }
+    toxprpl_icon_fetch_free(friend);
+
+    data = toxprpl_icon_cache_load(hash, &length);
+    if (data != NULL)
+    {
+        purple_debug_info("toxprpl", "Icon %s of %s is cached\n", checksum,
+                          friend->key);
+        toxprpl_icon_apply(friend, hash, data, length);
+        return;
+    }
+
+    if (size > TOXPRPL_ICON_MAX)
+    {
+        purple_debug_info("toxprpl", "Ignoring icon of %s, %u bytes is too "
+                          "large\n", friend->key, size);
+        return;
+    }
+
+    purple_debug_info("toxprpl", "Fetching icon %s (%u bytes) from %s\n",
+                      checksum, size, friend->key);
+    toxprpl_icon_fetch *fetch = g_new0(toxprpl_icon_fetch, 1);
+    memcpy(fetch->hash, hash, TOXPRPL_ICON_HASH_LEN);
+    fetch->size = size;
+    fetch->data = g_malloc(size);
+    friend->icon_fetch = fetch;
+    toxprpl_icon_request(friend);
+}
+
+static void toxprpl_on_icon_get(toxprpl_friend *friend, const guint8 *hash,
+                                guint32 offset)
+{
+    toxprpl_frame frame;
+    gsize size;
+
+    // a request for an icon we no longer use, the peer got the new hash
+    if ((g_tox_icon == NULL) ||
+        memcmp(hash, g_tox_icon_hash, TOXPRPL_ICON_HASH_LEN))
+    {
+        return;
+    }
+
+    const guint8 *icon = g_bytes_get_data(g_tox_icon, &size);
+    if (offset >= size)
+    {
+        return;
+    }
+
+    frame.type = TOXPRPL_FRAME_ICON_DATA;
+    frame.u.icon.hash = g_tox_icon_hash;
+    frame.u.icon.offset = offset;
+    frame.u.icon.size = size;
+    frame.u.icon.payload = icon + offset;
+    frame.u.icon.length = MIN(size - offset, TOXPRPL_FRAME_ICON_DATA_MAX);
+    toxprpl_send_frame(friend, TOXPRPL_LANE_BULK, &frame, NULL, NULL);
+}
+
+static void toxprpl_on_icon_data(toxprpl_friend *friend,
+                                 const toxprpl_frame *frame)
+{
+    toxprpl_icon_fetch *fetch = friend->icon_fetch;
+    guint8 check[TOXPRPL_ICON_HASH_LEN];
+
+    // late answers to requests that were repeated are simply dropped
+    if ((fetch == NULL) ||
+        memcmp(fetch->hash, frame->u.icon.hash, TOXPRPL_ICON_HASH_LEN) ||
+        (frame->u.icon.size != fetch->size) ||
+        (frame->u.icon.offset != fetch->offset) ||
+        (frame->u.icon.length == 0) ||
+        (frame->u.icon.length > fetch->size - fetch->offset))
+    {
+        return;
+    }
+
+    memcpy(fetch->data + fetch->offset, frame->u.icon.payload,
+           frame->u.icon.length);
+    fetch->offset += frame->u.icon.length;
+    fetch->retries = 0;
+    if (fetch->offset < fetch->size)
+    {
+        toxprpl_icon_request(friend);
+        return;
+    }
+
+    toxprpl_icon_hash(fetch->data, fetch->size, check);
+    if (memcmp(check, fetch->hash, TOXPRPL_ICON_HASH_LEN))
+    {
+        purple_debug_warning("toxprpl", "Icon from %s does not match its "
+                             "hash\n", friend->key);
+        toxprpl_icon_fetch_free(friend);
+        return;
+    }
+
+    toxprpl_icon_cache_store(fetch->hash, fetch->data, fetch->size);
+    toxprpl_icon_apply(friend, fetch->hash, fetch->data, fetch->size);
+    fetch->data = NULL;
+    toxprpl_icon_fetch_free(friend);
+}
+
+/* typing notifications */
+static gboolean toxprpl_typing_timer(gpointer data);
+
+/* shows the typing state of the peer, libpurple only hears about changes */
+static void toxprpl_typing_set(toxprpl_friend *friend, guint8 state)
+{
+    if (state == TOXPRPL_TYPING_NONE)
+    {
+        toxprpl_wheel_cancel(g_tox_wheel, friend->typing_timer);
+        friend->typing_timer = NULL;
+    }
+    else if (friend->typing_timer == NULL)
+    {
+        friend->typing_timer = toxprpl_wheel_add(g_tox_wheel,
+                TOXPRPL_TYPING_EXPIRE, 0, toxprpl_typing_timer, friend);
+    }
+    else
+    {
+        toxprpl_wheel_reschedule(g_tox_wheel, friend->typing_timer,
+                                 TOXPRPL_TYPING_EXPIRE);
+    }
+
+    if (state == friend->rx_typing)
+    {
+        return;
+    }
+    friend->rx_typing = state;
+    if (toxprpl_headless() || friend->replay)
+    {
+        return;
+    }
+
+    switch (state)
+    {
+        case TOXPRPL_TYPING_ACTIVE:
+            serv_got_typing(g_tox_gc, friend->key, 0, PURPLE_TYPING);
+            break;
+        case TOXPRPL_TYPING_PAUSED:
+            serv_got_typing(g_tox_gc, friend->key, 0, PURPLE_TYPED);
+            break;
+        default:
+            serv_got_typing_stopped(g_tox_gc, friend->key);
+            break;
+    }
+}
+
+static gboolean toxprpl_typing_timer(gpointer data)
+{
+    toxprpl_friend *friend = (toxprpl_friend *)data;
+
+    // one-shot, the peer stopped repeating its state
+    friend->typing_timer = NULL;
+    toxprpl_typing_set(friend, TOXPRPL_TYPING_NONE);
+    return FALSE;
+}
+
+static void toxprpl_on_typing(toxprpl_friend *friend, guint8 state)
+{
+    if (state > TOXPRPL_TYPING_PAUSED)
+    {
+        state = TOXPRPL_TYPING_NONE;
+    }
+    toxprpl_typing_set(friend, state);
+}
+
+static void toxprpl_typing_sent(gpointer data, gboolean sent)
+{
+    toxprpl_friend *friend = (toxprpl_friend *)data;
+    friend->typing_item = NULL;
+}
+
+static void toxprpl_on_hello(toxprpl_friend *friend, guint32 caps,
+                             guint32 epoch, guint32 tx_base)
+{
+    purple_debug_info("toxprpl", "Hello from %s, capabilities 0x%x\n",
+                      friend->key, caps);
+    friend->peer_caps = caps;
+
+    if (!friend->rx_synced || (epoch != friend->rx_epoch))
+    {
+        // new peer session, sequence numbers start over
+        toxprpl_rx_parts_clear(friend);
+        friend->rx_synced = TRUE;
+        friend->rx_epoch = epoch;
+        friend->rx_next = tx_base;
+        friend->rx_mask = 0;
+    }
+    else if ((gint32)(tx_base - friend->rx_next) > 0)
+    {
+        // the peer gave up on messages we never got
+        friend->rx_next = tx_base;
+        friend->rx_mask = 0;
+    }
+
+    // a hello while the session is up means the peer missed our answer
+    gboolean repeated = friend->session_ready;
+    friend->session_ready = TRUE;
+    toxprpl_wheel_cancel(g_tox_wheel, friend->hello_timer);
+    friend->hello_timer = NULL;
+    if (!friend->hello_sent || repeated)
+    {
+        toxprpl_send_hello(friend);
+    }
+
+    if (caps & TOXPRPL_CAP_ICONS)
+    {
+        toxprpl_icon_announce(friend);
+    }
+
+    if (!g_queue_is_empty(&friend->tx_queue))
+    {
+        toxprpl_tx_pump(friend, g_get_monotonic_time());
+    }
+}
+
+/* returns TRUE if the message should be shown, FALSE if it is a duplicate */
+static gboolean toxprpl_on_data(toxprpl_friend *friend, guint32 seq)
+{
+    // an ack is owed either way, the peer may have missed the previous one
+    friend->ack_pending = TRUE;
+    toxprpl_friend_schedule(friend);
+
+    if (!friend->rx_synced)
+    {
+        friend->rx_synced = TRUE;
+        friend->rx_next = seq;
+        friend->rx_mask = 0;
+    }
+
+    gint32 d = (gint32)(seq - friend->rx_next);
+    if ((d < 0) || ((d < 32) && (friend->rx_mask & (1u << d))))
+    {
+        purple_debug_info("toxprpl", "Dropping duplicate message %u from %s\n",
+                          seq, friend->key);
+        return FALSE;
+    }
+
+    if (d >= 32)
+    {
+        // way outside of the window, the peer must have lost its state
+        friend->rx_next = seq;
+        friend->rx_mask = 0;
+        d = 0;
+    }
+
+    friend->rx_mask |= (1u << d);
+    while (friend->rx_mask & 1)
+    {
+        friend->rx_mask >>= 1;
+        friend->rx_next++;
+    }
+    return TRUE;
+}
+
+/*
+ * returns the decompressed payload, NUL terminated and allocated from the
+ * arena, or NULL if it is corrupt
+ */
+static guint8 *toxprpl_rx_unpack(toxprpl_friend *friend, const guint8 *data,
+                                 gsize length, gsize *unpacked)
+{
+    gssize size = toxprpl_decompressed_length(data, length);
+    guint8 *buf = (size >= 0) ?
+                  toxprpl_arena_alloc(g_tox_arena, size + 1) : NULL;
+    gssize n = (buf != NULL) ?
+               toxprpl_decompress(data, length, buf, size) : -1;
+
+    if (n < 0)
+    {
+        purple_debug_warning("toxprpl", "Dropping corrupt message from %s\n",
+                             friend->key);
+        return NULL;
+    }
+    buf[n] = '\0';
+    *unpacked = n;
+    return buf;
+}
+
+/* TRUE if seq was received before, see toxprpl_on_data() */
+static gboolean toxprpl_rx_seen(toxprpl_friend *friend, guint32 seq)
+{
+    gint32 d = (gint32)(seq - friend->rx_next);
+    return (d < 0) || ((d < 32) && (friend->rx_mask & (1u << d)));
+}
+
+/* delivers every split message which is complete */
+static void toxprpl_rx_parts_assemble(toxprpl_friend *friend)
+{
+    GList *l = g_queue_peek_head_link(&friend->rx_parts);
+
+    while (l != NULL)
+    {
+        toxprpl_rx_part *part = l->data;
+
+        if (part->flags & TOXPRPL_DATA_CONT)
+        {
+            toxprpl_rx_part *prev = (l->prev != NULL) ? l->prev->data : NULL;
+            GList *next = l->next;
+            // its predecessor arrived but is gone, e.g. after a restart
+            if (((prev == NULL) || (prev->seq != part->seq - 1)) &&
+                toxprpl_rx_seen(friend, part->seq - 1))
+            {
+                g_queue_delete_link(&friend->rx_parts, l);
+                g_free(part);
+            }
+            l = next;
+            continue;
+        }
+
+        // a first part, see whether everything up to the last one is here
+        GList *end = l;
+        gsize total = part->length;
+        while ((end != NULL) &&
+               (((toxprpl_rx_part *)end->data)->flags & TOXPRPL_DATA_MORE))
+        {
+            toxprpl_rx_part *p = end->data;
+            toxprpl_rx_part *n = (end->next != NULL) ? end->next->data : NULL;
+            if ((n == NULL) || (n->seq != p->seq + 1) ||
+                !(n->flags & TOXPRPL_DATA_CONT))
+            {
+                end = NULL;
+                break;
+            }
+            end = end->next;
+            total += n->length;
+        }
+        if (end == NULL)
+        {
+            l = l->next;
+            continue;
+        }
+
+        gchar *text = toxprpl_arena_alloc(g_tox_arena, total + 1);
+        gboolean packed = (part->flags & TOXPRPL_DATA_LZ4) != 0;
+        gsize offset = 0;
+        GList *stop = end->next;
+        while (l != stop)
+        {
+            GList *next = l->next;
+            part = l->data;
+            memcpy(text + offset, part->data, part->length);
+            offset += part->length;
+            g_queue_delete_link(&friend->rx_parts, l);
+            g_free(part);
+            l = next;
+        }
+        text[offset] = '\0';
+        if (packed)
+        {
+            text = (gchar *)toxprpl_rx_unpack(friend, (const guint8 *)text,
+                                              offset, &offset);
+        }
+        if (text != NULL)
+        {
+            toxprpl_deliver_im(friend, text);
+        }
+    }
+}
+
+/* keeps a part of a split message, parts may arrive in any order */
+static void toxprpl_rx_part_add(toxprpl_friend *friend, guint32 seq,
+                                guint8 flags, const guint8 *data,
+                                guint16 length)
+{
+    toxprpl_rx_part *part = g_malloc(sizeof(toxprpl_rx_part) + length);
+    GList *l;
+
+    part->seq = seq;
+    part->flags = flags;
+    part->length = length;
+    memcpy(part->data, data, length);
+
+    for (l = g_queue_peek_tail_link(&friend->rx_parts); l; l = l->prev)
+    {
+        if ((gint32)(((toxprpl_rx_part *)l->data)->seq - seq) < 0)
+        {
+            break;
+        }
+    }
+    if (l != NULL)
+    {
+        g_queue_insert_after(&friend->rx_parts, l, part);
+    }
+    else
+    {
+        g_queue_push_head(&friend->rx_parts, part);
+    }
+
+    // the rest of the oldest message is not coming any more
+    if (g_queue_get_length(&friend->rx_parts) > TOXPRPL_RX_PARTS_MAX)
+    {
+        purple_debug_info("toxprpl", "Dropping part of a message from %s\n",
+                          friend->key);
+        g_free(g_queue_pop_head(&friend->rx_parts));
+    }
+    toxprpl_rx_parts_assemble(friend);
+}
+
+static void toxprpl_on_frame(toxprpl_friend *friend, const uint8_t *data,
+                             uint16_t length)
+{
+    toxprpl_frame frame;
+    if (!toxprpl_frame_decode(data, length, &frame))
+    {
+        purple_debug_info("toxprpl", "Ignoring unknown frame from %s\n",
+                          friend->key);
+        return;
+    }
+
+    // the peer runs tox-prpl after all, greet it again from now on
+    if (toxprpl_friend_silent(friend))
+    {
+        toxprpl_friend_set_silent(friend, FALSE);
+    }
+
+    switch (frame.type)
+    {
+        case TOXPRPL_FRAME_HELLO:
+            toxprpl_on_hello(friend, frame.u.hello.caps, frame.u.hello.epoch,
+                             frame.u.hello.tx_base);
+            break;
+        case TOXPRPL_FRAME_ACK:
+            toxprpl_on_ack(friend, frame.u.ack.next, frame.u.ack.mask);
+            break;
+        case TOXPRPL_FRAME_DATA:
+            if (!toxprpl_on_data(friend, frame.u.data.seq))
+            {
+                break;
+            }
+            if (frame.u.data.flags & (TOXPRPL_DATA_MORE | TOXPRPL_DATA_CONT))
+            {
+                // decompressed once the message is complete
+                toxprpl_rx_part_add(friend, frame.u.data.seq,
+                                    frame.u.data.flags, frame.u.data.payload,
+                                    frame.u.data.length);
+                break;
+            }
+            if (frame.u.data.flags & TOXPRPL_DATA_LZ4)
+            {
+                gsize n;
+                guint8 *buf = toxprpl_rx_unpack(friend, frame.u.data.payload,
+                                                frame.u.data.length, &n);
+                if (buf == NULL)
+                {
+                    break;
+                }
+                frame.u.data.payload = buf;
+                frame.u.data.length = n;
+            }
+            if (frame.u.data.flags & TOXPRPL_DATA_CHAT)
+            {
+                toxprpl_on_chat(friend, frame.u.data.payload,
+                                frame.u.data.length);
+            }
+            else
+            {
+                gchar *text = toxprpl_arena_strndup(g_tox_arena,
+                        (const gchar *)frame.u.data.payload,
+                        frame.u.data.length);
+                toxprpl_deliver_im(friend, text);
+            }
+            break;
+        case TOXPRPL_FRAME_ICON:
+            toxprpl_on_icon(friend, frame.u.icon.hash, frame.u.icon.size);
+            break;
+        case TOXPRPL_FRAME_ICON_GET:
+            toxprpl_on_icon_get(friend, frame.u.icon.hash,
+                                frame.u.icon.offset);
+            break;
+        case TOXPRPL_FRAME_ICON_DATA:
+            toxprpl_on_icon_data(friend, &frame);
+            break;
+        case TOXPRPL_FRAME_TYPING:
+            toxprpl_on_typing(friend, frame.u.typing.state);
+            break;
+        default:
+            break;
+    }
+}
+
+static void toxprpl_friend_online(toxprpl_friend *friend, gboolean online)
+{
+    GList *l;
+
+    friend->online = online;
+    friend->last_seen = time(NULL);
+    friend->session_ready = FALSE;
+    friend->hello_sent = FALSE;
+    toxprpl_wheel_cancel(g_tox_wheel, friend->hello_timer);
+    friend->hello_timer = NULL;
+
+    if (online)
+    {
+        toxprpl_hello_probe(friend);
+        return;
+    }
+
+    // the peer announces its icon again in the next session
+    toxprpl_icon_fetch_free(friend);
+    toxprpl_typing_set(friend, TOXPRPL_TYPING_NONE);
+    friend->tx_typing = TOXPRPL_TYPING_NONE;
+    toxprpl_chat_friend_gone(friend);
+
+    // whatever was in flight has to go out again in the next session
+    for (l = g_queue_peek_head_link(&friend->tx_queue); l; l = l->next)
+    {
+        toxprpl_tx_msg *msg = l->data;
+        toxprpl_sched_cancel(toxprpl_friend_sched(friend), msg->item);
+        msg->item = NULL;
+        msg->sent_at = 0;
+    }
+    // tox would refuse the rest anyway
+    toxprpl_sched_drop_friend(toxprpl_friend_sched(friend), friend->fnum);
+    toxprpl_friend_schedule(friend);
+}
+
+/* compresses each distinct shared payload only once */
+static void toxprpl_tx_msg_pack(toxprpl_tx_msg *msg, GBytes *shared)
+{
+    if (shared == NULL)
+    {
+        msg->packed_length = toxprpl_compress_buffer(msg->payload,
+                msg->length, msg->packed, sizeof(msg->packed));
+        return;
+    }
+
+    if (shared != g_tox_packed_in)
+    {
+        if (g_tox_packed_in != NULL)
+        {
+            g_bytes_unref(g_tox_packed_in);
+        }
+        // holding on to the payload keeps the pointer from being reused
+        g_tox_packed_in = g_bytes_ref(shared);
+        g_tox_packed_length = toxprpl_compress_buffer(msg->payload,
+                msg->length, g_tox_packed_out, sizeof(g_tox_packed_out));
+    }
+    memcpy(msg->packed, g_tox_packed_out, g_tox_packed_length);
+    msg->packed_length = g_tox_packed_length;
+}
+
+/*
+ * queues a copy of a payload for reliable delivery. shared is the payload
+ * if the same one is queued for several friends, NULL otherwise. Returns 1
+ * if queued, negative errno value if it can not be sent
+ */
+static int toxprpl_reliable_queue_data(toxprpl_friend *friend,
+                                       const guint8 *data, gsize length,
+                                       GBytes *shared, toxprpl_lane lane,
+                                       guint8 flags,
+                                       toxprpl_broadcast *broadcast,
+                                       guint rcpt)
+{
+    if (length > TOXPRPL_FRAME_DATA_MAX)
+    {
+        return -E2BIG;
+    }
+
+    if (g_queue_get_length(&friend->tx_queue) >= TOXPRPL_TX_QUEUE_MAX)
+    {
+        purple_debug_info("toxprpl", "Send queue for %s is full\n",
+                          friend->key);
+        return -ENOBUFS;
+    }
+
+    toxprpl_tx_msg *prev = g_queue_peek_tail(&friend->tx_queue);
+    toxprpl_tx_msg *msg = toxprpl_tx_msg_new();
+    msg->seq = friend->tx_next++;
+    // the parts of a split message are queued back to back
+    msg->first = ((flags & TOXPRPL_DATA_CONT) && (prev != NULL)) ?
+                 prev->first : msg->seq;
+    memcpy(msg->payload, data, length);
+    msg->length = length;
+    if ((friend->peer_caps & TOXPRPL_CAP_LZ4) &&
+        !(flags & TOXPRPL_DATA_LZ4))
+    {
+        toxprpl_tx_msg_pack(msg, shared);
+    }
+    msg->lane = lane;
+    msg->flags = flags;
+    msg->broadcast = broadcast;
+    msg->rcpt = rcpt;
+    msg->friend = friend;
+    g_queue_push_tail_link(&friend->tx_queue, &msg->link);
+
+    toxprpl_tx_pump(friend, g_get_monotonic_time());
+    return 1;
+}
+
+/* the same for a payload that broadcasts and chats share between friends */
+static int toxprpl_reliable_queue(toxprpl_friend *friend, GBytes *payload,
+                                  toxprpl_lane lane, guint8 flags,
+                                  toxprpl_broadcast *broadcast, guint rcpt)
+{
+    gsize length;
+    const guint8 *data = g_bytes_get_data(payload, &length);
+    return toxprpl_reliable_queue_data(friend, data, length, payload, lane,
+                                       flags, broadcast, rcpt);
+}
+
+/*
+ * long messages are split into parts which the peer puts together again,
+ * the message counts as delivered once every part was acknowledged
+ */
+static int toxprpl_reliable_send(toxprpl_friend *friend, const char *message)
+{
+    gsize length = strlen(message);
+    GBytes *text = NULL;
+    GBytes *packed = NULL;
+    guint8 flags = 0;
+
+    if (length > TOXPRPL_FRAME_DATA_MAX)
+    {
+        // the parts only carry pieces, the failure notice needs it all
+        text = g_bytes_new(message, length);
+        // a long message is compressed as a whole and the result is split,
+        // so it takes as few tox messages as possible
+        if (friend->peer_caps & TOXPRPL_CAP_LZ4)
+        {
+            packed = toxprpl_compress(text);
+        }
+    }
+
+    const guint8 *data = (const guint8 *)message;
+    if (packed != NULL)
+    {
+        data = g_bytes_get_data(packed, &length);
+    }
+    const guint8 *p = data;
+    gsize left = length;
+    guint parts = 0;
+
+    // all or nothing, half a paste is of no use
+    while (left > 0)
+    {
+        gsize n = (packed != NULL) ? MIN(left, TOXPRPL_FRAME_DATA_MAX) :
+                  toxprpl_chunk_length((const char *)p, left,
+                                       TOXPRPL_FRAME_DATA_MAX);
+        p += n;
+        left -= n;
+        parts++;
+    }
+    if (g_queue_get_length(&friend->tx_queue) + MAX(parts, 1) >
+        TOXPRPL_TX_QUEUE_MAX)
+    {
+        if (packed != NULL)
+        {
+            g_bytes_unref(packed);
+        }
+        if (text != NULL)
+        {
+            g_bytes_unref(text);
+        }
+        return -ENOBUFS;
+    }
+
+    toxprpl_lane lane = (parts > 1) ? TOXPRPL_LANE_BULK :
+                                      TOXPRPL_LANE_INTERACTIVE;
+    if (packed != NULL)
+    {
+        flags |= TOXPRPL_DATA_LZ4;
+    }
+
+    int ret = 1;
+    p = data;
+    left = length;
+    do
+    {
+        gsize n = (packed != NULL) ? MIN(left, TOXPRPL_FRAME_DATA_MAX) :
+                  toxprpl_chunk_length((const char *)p, left,
+                                       TOXPRPL_FRAME_DATA_MAX);
+        if (left > n)
+        {
+            flags |= TOXPRPL_DATA_MORE;
+        }
+        else
+        {
+            flags &= ~TOXPRPL_DATA_MORE;
+        }
+        ret = toxprpl_reliable_queue_data(friend, p, n, NULL, lane, flags,
+                                          NULL, 0);
+        if ((ret > 0) && (text != NULL))
+        {
+            toxprpl_tx_msg *msg = g_queue_peek_tail(&friend->tx_queue);
+            msg->text = g_bytes_ref(text);
+        }
+        p += n;
+        left -= n;
+        flags |= TOXPRPL_DATA_CONT;
+    } while ((left > 0) && (ret > 0));
+
+    if (packed != NULL)
+    {
+        g_bytes_unref(packed);
+    }
+    if (text != NULL)
+    {
+        g_bytes_unref(text);
+    }
+    return ret;
+}
+
+/* broadcasts */
+static const char *toxprpl_rcpt_state_name(toxprpl_rcpt_state state)
+{
+    switch (state)
+    {
+        case TOXPRPL_RCPT_QUEUED:
+            return "queued";
+        case TOXPRPL_RCPT_DELIVERED:
+            return "delivered";
+        case TOXPRPL_RCPT_SENT:
+            return "sent";
+        case TOXPRPL_RCPT_FAILED:
+            return "failed";
+        case TOXPRPL_RCPT_PENDING:
+        default:
+            return "pending";
+    }
+}
+
+static void toxprpl_broadcast_free(toxprpl_broadcast *broadcast)
+{
+    g_bytes_unref(broadcast->payload);
+    g_free(broadcast->rcpts);
+    g_free(broadcast);
+}
+
+static void toxprpl_broadcast_report(toxprpl_broadcast *broadcast)
+{
+    guint i;
+    GString *text = g_string_new(NULL);
+
+    g_string_append_printf(text, _("Delivered: %u<br>Sent without receipt: "
+                                   "%u<br>Queued: %u<br>Failed: %u<br><br>"),
+                           broadcast->delivered, broadcast->sent,
+                           broadcast->queued, broadcast->failed);
+    for (i = 0; i < broadcast->count; i++)
+    {
+        g_string_append_printf(text, "%s: %s<br>",
+                broadcast->rcpts[i].key,
+                toxprpl_rcpt_state_name(broadcast->rcpts[i].state));
+    }
+
+    if (g_tox_gc != NULL)
+    {
+        purple_notify_formatted(g_tox_gc, _("Broadcast"),
+                                _("Broadcast finished"), NULL, text->str,
+                                NULL, NULL);
+    }
+    g_string_free(text, TRUE);
+}
+
+/* records the final state of a recipient, finishes the broadcast if done */
+static void toxprpl_broadcast_done(toxprpl_broadcast *broadcast, guint rcpt,
+                                   toxprpl_rcpt_state state)
+{
+    toxprpl_broadcast_rcpt *r = &broadcast->rcpts[rcpt];
+
+    if (r->state == TOXPRPL_RCPT_QUEUED)
+    {
+        broadcast->queued--;
+    }
+    r->state = state;
+    if (state == TOXPRPL_RCPT_DELIVERED)
+    {
+        broadcast->delivered++;
+    }
+    else if (state == TOXPRPL_RCPT_SENT)
+    {
+        broadcast->sent++;
+    }
+    else
+    {
+        broadcast->failed++;
+    }
+
+    if (toxprpl_gateway_client_count(g_tox_gateway) > 0)
+    {
+        gchar *id = toxprpl_arena_printf(g_tox_arena, "%u", broadcast->id);
+        gchar *text = toxprpl_arena_printf(g_tox_arena, "%s %s %u %u %u %u",
+                r->key, toxprpl_rcpt_state_name(state),
+                broadcast->delivered, broadcast->queued, broadcast->failed,
+                broadcast->sent);
+        toxprpl_gateway_emit(g_tox_gateway, "BCAST", id, text);
+    }
+
+    if ((broadcast->next < broadcast->count) || (broadcast->queued > 0))
+    {
+        return;
+    }
+
+    purple_debug_info("toxprpl", "Broadcast %u finished: %u delivered, "
+                      "%u sent, %u failed\n", broadcast->id,
+                      broadcast->delivered, broadcast->sent,
+                      broadcast->failed);
+    g_queue_remove(&g_tox_broadcasts, broadcast);
+    if (toxprpl_gateway_client_count(g_tox_gateway) == 0)
+    {
+        toxprpl_broadcast_report(broadcast);
+    }
+    toxprpl_broadcast_free(broadcast);
+}
+
+/* a plain broadcast message left its lane (or was dropped) */
+static void toxprpl_broadcast_plain_done(gpointer data, gboolean sent)
+{
+    toxprpl_broadcast_rcpt *r = (toxprpl_broadcast_rcpt *)data;
+    toxprpl_broadcast_done(r->broadcast, r - r->broadcast->rcpts,
+                           sent ? TOXPRPL_RCPT_SENT : TOXPRPL_RCPT_FAILED);
+}
+
+/* hands the next recipient of the broadcast to tox */
+static void toxprpl_broadcast_dispatch(toxprpl_broadcast *broadcast)
+{
+    guint i = broadcast->next++;
+    toxprpl_broadcast_rcpt *r = &broadcast->rcpts[i];
+    toxprpl_friend *friend = toxprpl_friend_get(r->fnum);
+
+    // the buddy was removed meanwhile and tox may have reused the number
+    if ((friend == NULL) || strcmp(friend->key, r->key))
+    {
+        toxprpl_broadcast_done(broadcast, i, TOXPRPL_RCPT_FAILED);
+    }
+    else if (friend->peer_caps & TOXPRPL_CAP_RECEIPTS)
+    {
+        // mark as queued first, an immediate ack may finish it right away
+        r->state = TOXPRPL_RCPT_QUEUED;
+        broadcast->queued++;
+        if (toxprpl_reliable_queue(friend, broadcast->payload,
+                                   TOXPRPL_LANE_BULK, 0, broadcast, i) < 0)
+        {
+            toxprpl_broadcast_done(broadcast, i, TOXPRPL_RCPT_FAILED);
+        }
+    }
+    else
+    {
+        // no receipts, the best we know is whether tox took the message
+        gsize length;
+        gchar buf[TOXPRPL_FRAME_MAX + 1];
+        const guint8 *data = g_bytes_get_data(broadcast->payload, &length);
+        memcpy(buf, data, length);
+        buf[length] = '\0';
+        r->state = TOXPRPL_RCPT_QUEUED;
+        broadcast->queued++;
+        if (toxprpl_send_plain(r->fnum, buf, toxprpl_broadcast_plain_done,
+                               r) < 0)
+        {
+            toxprpl_broadcast_done(broadcast, i, TOXPRPL_RCPT_FAILED);
+        }
+    }
+}
+
+/*
+ * called from the messenger loop, spends the send budget of this tick
+ * round robin over all running broadcasts
+ */
+static void toxprpl_broadcast_tick(void)
+{
+    gint64 now = g_get_monotonic_time();
+    int rate = TOXPRPL_BROADCAST_RATE;
+
+    if (g_queue_is_empty(&g_tox_broadcasts))
+    {
+        g_tox_broadcast_last = now;
+        g_tox_broadcast_tokens = 0;
+        return;
+    }
+
+    if (g_tox_gc != NULL)
+    {
+        rate = purple_account_get_int(purple_connection_get_account(g_tox_gc),
+                                      "broadcast_rate",
+                                      TOXPRPL_BROADCAST_RATE);
+        rate = MAX(rate, 1);
+    }
+
+    // allow a burst of at most one second worth of messages
+    g_tox_broadcast_tokens += (gdouble)rate *
+        (now - g_tox_broadcast_last) / G_USEC_PER_SEC;
+    g_tox_broadcast_tokens = MIN(g_tox_broadcast_tokens, rate);
+    g_tox_broadcast_last = now;
+
+    guint idle = 0;
+    while ((g_tox_broadcast_tokens >= 1) &&
+           (idle < g_queue_get_length(&g_tox_broadcasts)))
+    {
+        toxprpl_broadcast *broadcast = g_queue_pop_head(&g_tox_broadcasts);
+        g_queue_push_tail(&g_tox_broadcasts, broadcast);
+
+        if (broadcast->next >= broadcast->count)
+        {
+            // everything handed out, only waiting for receipts
+            idle++;
+            continue;
+        }
+
+        idle = 0;
+        g_tox_broadcast_tokens -= 1;
+        toxprpl_broadcast_dispatch(broadcast);
+    }
+}
+
+/*
+ * starts a broadcast to the given recipients (fnum and key set), takes over
+ * rcpts. Returns the broadcast id or a negative errno value
+ */
+static int toxprpl_broadcast_start(const char *message,
+                                   toxprpl_broadcast_rcpt *rcpts, guint count)
+{
+    guint i;
+    size_t length = strlen(message);
+
+    if ((length > TOXPRPL_FRAME_DATA_MAX) || (count == 0))
+    {
+        g_free(rcpts);
+        return (count == 0) ? -EINVAL : -E2BIG;
+    }
+
+    toxprpl_broadcast *broadcast = g_new0(toxprpl_broadcast, 1);
+    broadcast->id = ++g_tox_broadcast_id;
+    broadcast->payload = g_bytes_new(message, length);
+    broadcast->rcpts = rcpts;
+    broadcast->count = count;
+    for (i = 0; i < count; i++)
+    {
+        broadcast->rcpts[i].state = TOXPRPL_RCPT_PENDING;
+        broadcast->rcpts[i].broadcast = broadcast;
+    }
+
+    purple_debug_info("toxprpl", "Broadcast %u to %u friends\n",
+                      broadcast->id, count);
+    g_queue_push_tail(&g_tox_broadcasts, broadcast);
+    return broadcast->id;
+}
+
+/* resolves buddy keys (or all buddies if keys is NULL) to recipients */
+static int toxprpl_broadcast_to_buddies(const char *message, gchar **keys)
+{
+    PurpleAccount *account = purple_connection_get_account(g_tox_gc);
+    GArray *rcpts = g_array_new(FALSE, TRUE, sizeof(toxprpl_broadcast_rcpt));
+    GSList *buddy_list = NULL;
+    GSList *l;
+    int ret;
+
+    if (keys == NULL)
+    {
+        buddy_list = purple_find_buddies(account, NULL);
+    }
+    else
+    {
+        gchar **key;
+        for (key = keys; *key != NULL; key++)
+        {
+            PurpleBuddy *buddy = purple_find_buddy(account, *key);
+            if (buddy != NULL)
+            {
+                buddy_list = g_slist_prepend(buddy_list, buddy);
+            }
+        }
+    }
+
+    for (l = buddy_list; l != NULL; l = l->next)
+    {
+        PurpleBuddy *buddy = (PurpleBuddy *)l->data;
+        toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
+        if ((buddy_data != NULL) && (buddy_data->tox_friendlist_number >= 0))
+        {
+            toxprpl_broadcast_rcpt rcpt;
+            memset(&rcpt, 0, sizeof(rcpt));
+            rcpt.fnum = buddy_data->tox_friendlist_number;
+            g_strlcpy(rcpt.key, buddy->name, sizeof(rcpt.key));
+            g_array_append_val(rcpts, rcpt);
+        }
+    }
+    g_slist_free(buddy_list);
+
+    guint count = rcpts->len;
+    ret = toxprpl_broadcast_start(message,
+            (toxprpl_broadcast_rcpt *)g_array_free(rcpts, FALSE), count);
+    return ret;
+}
+
+static void toxprpl_broadcast_free_all(void)
+{
+    GHashTableIter iter;
+    gpointer value;
+    toxprpl_broadcast *broadcast;
+
+    // queued recipients stay in the tx queues as regular messages
+    g_hash_table_iter_init(&iter, g_tox_friends);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        GList *l;
+        toxprpl_friend *friend = (toxprpl_friend *)value;
+        for (l = g_queue_peek_head_link(&friend->tx_queue); l; l = l->next)
+        {
+            ((toxprpl_tx_msg *)l->data)->broadcast = NULL;
+        }
+    }
+
+    while ((broadcast = g_queue_pop_head(&g_tox_broadcasts)) != NULL)
+    {
+        toxprpl_broadcast_free(broadcast);
+    }
+}
+
+/* tox specific stuff */
+/* group chats, see chat.h */
+static toxprpl_chat *toxprpl_chat_find(int id)
+{
+    if (g_tox_chats == NULL)
+    {
+        return NULL;
+    }
+    return g_hash_table_lookup(g_tox_chats, GINT_TO_POINTER(id));
+}
+
+/* rooms are keyed by the hub's friend number (-1 for ours) and the room id */
+static gint64 toxprpl_chat_room_key(int hub, guint32 room)
+{
+    return (gint64)(((guint64)(guint32)hub << 32) | room);
+}
+
+static toxprpl_chat *toxprpl_chat_find_room(int hub, guint32 room)
+{
+    gint64 key = toxprpl_chat_room_key(hub, room);
+    return g_hash_table_lookup(g_tox_chat_rooms, &key);
+}
+
+static void toxprpl_chat_forget_room(toxprpl_chat *chat)
+{
+    gint64 key = toxprpl_chat_room_key(chat->hub, chat->room);
+    g_hash_table_remove(g_tox_chat_rooms, &key);
+}
+
+static PurpleConvChat *toxprpl_chat_conv(toxprpl_chat *chat)
+{
+    PurpleConversation *conv = purple_find_chat(g_tox_gc, chat->id);
+    return (conv != NULL) ? purple_conversation_get_chat_data(conv) : NULL;
+}
+
+static toxprpl_chat *toxprpl_chat_open(guint32 room, int hub,
+                                       const char *name)
+{
+    toxprpl_chat *chat = toxprpl_chat_new(++g_tox_chat_id, room, hub, name);
+    gint64 *key = g_new(gint64, 1);
+    *key = toxprpl_chat_room_key(hub, room);
+    g_hash_table_insert(g_tox_chats, GINT_TO_POINTER(chat->id), chat);
+    g_hash_table_insert(g_tox_chat_rooms, key, chat);
+    serv_got_joined_chat(g_tox_gc, chat->id, name);
+    return chat;
+}
+
+static void toxprpl_chat_close(toxprpl_chat *chat)
+{
+    toxprpl_chat_forget_room(chat);
+    g_hash_table_remove(g_tox_chats, GINT_TO_POINTER(chat->id));
+}
+
+/* the room went away under us, tell the user and close the conversation */
+static void toxprpl_chat_closed(toxprpl_chat *chat)
+{
+    PurpleConvChat *conv = toxprpl_chat_conv(chat);
+    if (conv != NULL)
+    {
+        purple_conv_chat_write(conv, "", _("The room was closed"),
+                               PURPLE_MESSAGE_SYSTEM, time(NULL));
+    }
+    serv_got_chat_left(g_tox_gc, chat->id);
+}
+
+static int toxprpl_chat_send_to(toxprpl_friend *friend, toxprpl_chat_op op,
+                                guint32 room, const guint8 *key,
+                                const gchar *text, gsize length)
+{
+    if (length > TOXPRPL_CHAT_TEXT_MAX)
+    {
+        return -E2BIG;
+    }
+
+    // members only send JOIN, LEAVE and MSG, anything else comes from a hub
+    guint8 flags = ((op == TOXPRPL_CHAT_JOIN) || (op == TOXPRPL_CHAT_LEAVE) ||
+                    (op == TOXPRPL_CHAT_MSG)) ? 0 : TOXPRPL_CHAT_FROM_HUB;
+    toxprpl_chat_msg msg = { op, flags, room, key, text, length };
+    GBytes *payload = toxprpl_chat_encode(&msg);
+
+    int ret = toxprpl_reliable_queue(friend, payload,
+                                     TOXPRPL_LANE_INTERACTIVE,
+                                     TOXPRPL_DATA_CHAT, NULL, 0);
+    g_bytes_unref(payload);
+    return ret;
+}
+
+/* hub only: encodes once and queues the same payload for every member */
+static void toxprpl_chat_fanout(toxprpl_chat *chat, toxprpl_chat_op op,
+                                const guint8 *key, const gchar *text,
+                                gsize length, toxprpl_chat_member *except)
+{
+    toxprpl_chat_msg msg = { op, TOXPRPL_CHAT_FROM_HUB, chat->room, key, text,
+                             length };
+    GHashTableIter iter;
+    gpointer value;
+
+    if (length > TOXPRPL_CHAT_TEXT_MAX)
+    {
+        return;
+    }
+
+    GBytes *payload = toxprpl_chat_encode(&msg);
+
+    g_hash_table_iter_init(&iter, chat->members);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_chat_member *member = (toxprpl_chat_member *)value;
+        toxprpl_friend *friend;
+
+        if ((member == except) || (member->fnum < 0) ||
+            ((friend = toxprpl_friend_find(member->fnum)) == NULL))
+        {
+            continue;
+        }
+        if (toxprpl_reliable_queue(friend, payload, TOXPRPL_LANE_INTERACTIVE,
+                                   TOXPRPL_DATA_CHAT, NULL, 0) < 0)
+        {
+            purple_debug_info("toxprpl", "Chat update for %s dropped\n",
+                              member->key);
+        }
+    }
+    g_bytes_unref(payload);
+}
+
+/* hub only: the member list for a new member, as few messages as possible */
+static void toxprpl_chat_send_members(toxprpl_chat *chat,
+                                      toxprpl_friend *friend)
+{
+    GByteArray *text = g_byte_array_new();
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, chat->members);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_chat_member *member = (toxprpl_chat_member *)value;
+        if (!toxprpl_chat_entry_append(text, member->id, member->name))
+        {
+            toxprpl_chat_send_to(friend, TOXPRPL_CHAT_MEMBERS, chat->room,
+                                 NULL, (const gchar *)text->data, text->len);
+            g_byte_array_set_size(text, 0);
+            toxprpl_chat_entry_append(text, member->id, member->name);
+        }
+    }
+    if (text->len > 0)
+    {
+        toxprpl_chat_send_to(friend, TOXPRPL_CHAT_MEMBERS, chat->room, NULL,
+                             (const gchar *)text->data, text->len);
+    }
+    g_byte_array_free(text, TRUE);
+}
+
+static void toxprpl_chat_hub_join(toxprpl_chat *chat, toxprpl_friend *friend)
+{
+    uint8_t id[CLIENT_ID_SIZE];
+
+    if (!g_hash_table_remove(chat->invited, friend->key))
+    {
+        purple_debug_info("toxprpl", "%s was not invited to %s\n",
+                          friend->key, chat->name);
+        return;
+    }
+
+    toxprpl_tox_hex_string_to_id(friend->key, id);
+    toxprpl_chat_member *member = toxprpl_chat_member_add(chat, id,
+            friend->fnum, friend->name);
+    if (member == NULL)
+    {
+        return;
+    }
+
+    toxprpl_chat_fanout(chat, TOXPRPL_CHAT_ADD, member->id, member->name,
+                        strlen(member->name), member);
+    toxprpl_chat_send_members(chat, friend);
+
+    PurpleConvChat *conv = toxprpl_chat_conv(chat);
+    if (conv != NULL)
+    {
+        purple_conv_chat_add_user(conv, member->name, NULL,
+                                  PURPLE_CBFLAGS_NONE, TRUE);
+    }
+}
+
+static void toxprpl_chat_hub_remove(toxprpl_chat *chat,
+                                    toxprpl_chat_member *member)
+{
+    PurpleConvChat *conv = toxprpl_chat_conv(chat);
+
+    toxprpl_chat_fanout(chat, TOXPRPL_CHAT_DEL, member->id, NULL, 0, member);
+    if (conv != NULL)
+    {
+        purple_conv_chat_remove_user(conv, member->name, NULL);
+    }
+    toxprpl_chat_member_remove(chat, member);
+}
+
+/* messages from members of a room we host */
+static void toxprpl_chat_hub_receive(toxprpl_chat *chat,
+                                     toxprpl_friend *friend,
+                                     const toxprpl_chat_msg *msg)
+{
+    toxprpl_chat_member *member;
+
+    if (msg->op == TOXPRPL_CHAT_JOIN)
+    {
+        toxprpl_chat_hub_join(chat, friend);
+        return;
+    }
+
+    member = toxprpl_chat_member_find(chat, friend->key);
+    if (member == NULL)
+    {
+        return;
+    }
+
+    switch (msg->op)
+    {
+        case TOXPRPL_CHAT_LEAVE:
+            toxprpl_chat_hub_remove(chat, member);
+            break;
+        case TOXPRPL_CHAT_MSG:
+            toxprpl_chat_fanout(chat, TOXPRPL_CHAT_MSG, member->id,
+                                msg->text, msg->length, member);
+            serv_got_chat_in(g_tox_gc, chat->id, member->name,
+                             PURPLE_MESSAGE_RECV,
+                             toxprpl_arena_strndup(g_tox_arena, msg->text,
+                                                   msg->length),
+                             time(NULL));
+            break;
+        default:
+            break;
+    }
+}
+
+static void toxprpl_chat_add_member(toxprpl_chat *chat, PurpleConvChat *conv,
+                                    const guint8 *id, const gchar *name,
+                                    guint length, GList **names)
+{
+    toxprpl_chat_member *member = toxprpl_chat_member_add(chat, id, -1,
+            toxprpl_arena_strndup(g_tox_arena, name, length));
+    if (member == NULL)
+    {
+        return;
+    }
+
+    if (memcmp(id, self_public_key, CLIENT_ID_SIZE) == 0)
+    {
+        purple_conv_chat_set_nick(conv, member->name);
+    }
+
+    if (names != NULL)
+    {
+        *names = g_list_prepend(*names, member->name);
+    }
+    else
+    {
+        purple_conv_chat_add_user(conv, member->name, NULL,
+                                  PURPLE_CBFLAGS_NONE, TRUE);
+    }
+}
+
+/* updates from the hub of a room we joined */
+static void toxprpl_chat_member_receive(toxprpl_chat *chat,
+                                        const toxprpl_chat_msg *msg)
+{
+    PurpleConvChat *conv = toxprpl_chat_conv(chat);
+    gchar key[CLIENT_ID_SIZE * 2 + 1];
+    toxprpl_chat_member *member;
+
+    if (conv == NULL)
+    {
+        return;
+    }
+
+    toxprpl_tox_bin_id_to_string(msg->key, key);
+    member = toxprpl_chat_member_find(chat, key);
+
+    switch (msg->op)
+    {
+        case TOXPRPL_CHAT_CLOSE:
+            toxprpl_chat_closed(chat);
+            toxprpl_chat_close(chat);
+            break;
+        case TOXPRPL_CHAT_MSG:
+            serv_got_chat_in(g_tox_gc, chat->id,
+                             (member != NULL) ? member->name : key,
+                             PURPLE_MESSAGE_RECV,
+                             toxprpl_arena_strndup(g_tox_arena, msg->text,
+                                                   msg->length),
+                             time(NULL));
+            break;
+        case TOXPRPL_CHAT_MEMBERS:
+        {
+            // one UI update for the whole batch
+            GList *names = NULL;
+            GList *flags = NULL;
+            const guint8 *id;
+            const gchar *name;
+            guint length;
+            guint pos = 0;
+
+            while (toxprpl_chat_entry_next(msg, &pos, &id, &name, &length))
+            {
+                toxprpl_chat_add_member(chat, conv, id, name, length, &names);
+            }
+            GList *l;
+            for (l = names; l != NULL; l = l->next)
+            {
+                flags = g_list_prepend(flags,
+                                       GINT_TO_POINTER(PURPLE_CBFLAGS_NONE));
+            }
+            purple_conv_chat_add_users(conv, names, NULL, flags, FALSE);
+            g_list_free(flags);
+            g_list_free(names);
+            break;
+        }
+        case TOXPRPL_CHAT_ADD:
+            toxprpl_chat_add_member(chat, conv, msg->key, msg->text,
+                                    msg->length, NULL);
+            break;
+        case TOXPRPL_CHAT_DEL:
+            if (member != NULL)
+            {
+                purple_conv_chat_remove_user(conv, member->name, NULL);
+                toxprpl_chat_member_remove(chat, member);
+            }
+            break;
+        case TOXPRPL_CHAT_NICK:
+            if (member != NULL)
+            {
+                gchar *old = toxprpl_chat_member_rename(chat, member,
+                        toxprpl_arena_strndup(g_tox_arena, msg->text,
+                                              msg->length));
+                if (old != NULL)
+                {
+                    purple_conv_chat_rename_user(conv, old, member->name);
+                    g_free(old);
+                }
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void toxprpl_chat_on_invite(toxprpl_friend *friend,
+                                   const toxprpl_chat_msg *msg)
+{
+    GHashTable *components = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                   g_free, g_free);
+    gchar *name = g_strndup(msg->text, msg->length);
+
+    if (toxprpl_chat_find_room(friend->fnum, msg->room) != NULL)
+    {
+        g_free(name);
+        g_hash_table_destroy(components);
+        return;
+    }
+
+    g_hash_table_insert(components, g_strdup("room"), name);
+    g_hash_table_insert(components, g_strdup("hub"), g_strdup(friend->key));
+    g_hash_table_insert(components, g_strdup("id"),
+                        g_strdup_printf("%u", msg->room));
+    serv_got_chat_invite(g_tox_gc, name, friend->key, NULL, components);
+}
+
+static void toxprpl_on_chat(toxprpl_friend *friend, const guint8 *data,
+                            guint16 length)
+{
+    toxprpl_chat_msg msg;
+    toxprpl_chat *chat;
+
+    // rooms live in the UI, replayed chat traffic is not played into them
+    if ((g_tox_chats == NULL) || friend->replay ||
+        !toxprpl_chat_decode(data, length, &msg))
+    {
+        purple_debug_info("toxprpl", "Ignoring chat message from %s\n",
+                          friend->key);
+        return;
+    }
+
+    if (msg.op == TOXPRPL_CHAT_INVITE)
+    {
+        toxprpl_chat_on_invite(friend, &msg);
+        return;
+    }
+
+    if (msg.flags & TOXPRPL_CHAT_FROM_HUB)
+    {
+        chat = toxprpl_chat_find_room(friend->fnum, msg.room);
+        if (chat != NULL)
+        {
+            toxprpl_chat_member_receive(chat, &msg);
+        }
+    }
+    else
+    {
+        chat = toxprpl_chat_find_room(-1, msg.room);
+        if (chat != NULL)
+        {
+            toxprpl_chat_hub_receive(chat, friend, &msg);
+        }
+    }
+}
+
+/* the friend went offline or was removed */
+static void toxprpl_chat_friend_gone(toxprpl_friend *friend)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    if ((g_tox_chats == NULL) || friend->replay)
+    {
+        return;
+    }
+
+    g_hash_table_iter_init(&iter, g_tox_chats);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_chat *chat = (toxprpl_chat *)value;
+
+        if (chat->hub == friend->fnum)
+        {
+            toxprpl_chat_closed(chat);
+            toxprpl_chat_forget_room(chat);
+            g_hash_table_iter_remove(&iter);
+        }
+        else if (chat->hub < 0)
+        {
+            toxprpl_chat_member *member = toxprpl_chat_member_find(chat,
+                    friend->key);
+            if (member != NULL)
+            {
+                toxprpl_chat_hub_remove(chat, member);
+            }
+            g_hash_table_remove(chat->invited, friend->key);
+        }
+    }
+}
+
+/* the friend changed its nick, only the hub tells the rooms */
+static void toxprpl_chat_friend_renamed(toxprpl_friend *friend)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    if (g_tox_chats == NULL)
+    {
+        return;
+    }
+
+    g_hash_table_iter_init(&iter, g_tox_chats);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_chat *chat = (toxprpl_chat *)value;
+        toxprpl_chat_member *member;
+        gchar *old;
+
+        if ((chat->hub >= 0) ||
+            ((member = toxprpl_chat_member_find(chat, friend->key)) == NULL) ||
+            ((old = toxprpl_chat_member_rename(chat, member,
+                                               friend->name)) == NULL))
+        {
+            continue;
+        }
+
+        toxprpl_chat_fanout(chat, TOXPRPL_CHAT_NICK, member->id,
+                            member->name, strlen(member->name), NULL);
+        PurpleConvChat *conv = toxprpl_chat_conv(chat);
+        if (conv != NULL)
+        {
+            purple_conv_chat_rename_user(conv, old, member->name);
+        }
+        g_free(old);
+    }
+}
+
+static GList *toxprpl_chat_info(PurpleConnection *gc)
+{
+    struct proto_chat_entry *pce = g_new0(struct proto_chat_entry, 1);
+    pce->label = _("_Room:");
+    pce->identifier = "room";
+    pce->required = TRUE;
+    return g_list_append(NULL, pce);
+}
+
+static GHashTable *toxprpl_chat_info_defaults(PurpleConnection *gc,
+                                              const char *room)
+{
+    GHashTable *defaults = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 NULL, g_free);
+    g_hash_table_insert(defaults, "room", g_strdup(room));
+    return defaults;
+}
+
+static char *toxprpl_get_chat_name(GHashTable *components)
+{
+    return g_strdup(g_hash_table_lookup(components, "room"));
+}
+
+/* creates a room we host, or joins one we were invited to */
+static void toxprpl_join_chat(PurpleConnection *gc, GHashTable *components)
+{
+    PurpleAccount *account = purple_connection_get_account(gc);
+    const char *name = g_hash_table_lookup(components, "room");
+    const char *hub = g_hash_table_lookup(components, "hub");
+    const char *id = g_hash_table_lookup(components, "id");
+    toxprpl_chat *chat;
+    guint32 room;
+
+    if ((name == NULL) || (*name == '\0'))
+    {
+        return;
+    }
+
+    if ((hub != NULL) && (id != NULL))
+    {
+        PurpleBuddy *buddy = purple_find_buddy(account, hub);
+        toxprpl_friend *friend = (buddy != NULL) ?
+                                 toxprpl_friend_find_buddy(buddy) : NULL;
+
+        room = (guint32)g_ascii_strtoull(id, NULL, 10);
+        if ((friend != NULL) &&
+            (toxprpl_chat_find_room(friend->fnum, room) != NULL))
+        {
+            return;
+        }
+        if ((friend == NULL) || !friend->session_ready ||
+            (toxprpl_chat_send_to(friend, TOXPRPL_CHAT_JOIN, room, NULL,
+                                  NULL, 0) < 0))
+        {
+            purple_notify_error(gc, _("Group Chat"), _("Could not join"),
+                                _("The creator of the room is not online."));
+            return;
+        }
+        // the member list follows from the hub
+        toxprpl_chat_open(room, friend->fnum, name);
+        return;
+    }
+
+    do
+    {
+        room = g_random_int();
+    } while ((room == 0) || (toxprpl_chat_find_room(-1, room) != NULL));
+
+    chat = toxprpl_chat_open(room, -1, name);
+    toxprpl_chat_member *self = toxprpl_chat_member_add(chat,
+            self_public_key, -1, purple_connection_get_display_name(gc));
+    PurpleConvChat *conv = toxprpl_chat_conv(chat);
+    if (conv != NULL)
+    {
+        purple_conv_chat_set_nick(conv, self->name);
+        purple_conv_chat_add_user(conv, self->name, NULL,
+                                  PURPLE_CBFLAGS_FOUNDER, FALSE);
+    }
+}
+
+static void toxprpl_chat_invite(PurpleConnection *gc, int id,
+                                const char *message, const char *who)
+{
+    PurpleAccount *account = purple_connection_get_account(gc);
+    toxprpl_chat *chat = toxprpl_chat_find(id);
+    PurpleBuddy *buddy = purple_find_buddy(account, who);
+    toxprpl_friend *friend = (buddy != NULL) ?
+                             toxprpl_friend_find_buddy(buddy) : NULL;
+    PurpleConvChat *conv;
+
+    if ((chat == NULL) || ((conv = toxprpl_chat_conv(chat)) == NULL))
+    {
+        return;
+    }
+
+    if (chat->hub >= 0)
+    {
+        purple_conv_chat_write(conv, "",
+                _("Only the creator of the room can invite"),
+                PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_ERROR, time(NULL));
+        return;
+    }
+
+    if ((friend == NULL) || !friend->session_ready ||
+        !(friend->peer_caps & TOXPRPL_CAP_CHAT))
+    {
+        gchar *text = g_strdup_printf(_("%s can not join group chats right "
+                                        "now"), who);
+        purple_conv_chat_write(conv, "", text,
+                PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_ERROR, time(NULL));
+        g_free(text);
+        return;
+    }
+
+    g_hash_table_replace(chat->invited, g_strdup(friend->key),
+                         GINT_TO_POINTER(1));
+    toxprpl_chat_send_to(friend, TOXPRPL_CHAT_INVITE, chat->room, NULL,
+                         chat->name, strlen(chat->name));
+}
+
+static void toxprpl_chat_leave(PurpleConnection *gc, int id)
+{
+    toxprpl_chat *chat = toxprpl_chat_find(id);
+    if (chat == NULL)
+    {
+        return;
+    }
+
+    if (chat->hub < 0)
+    {
+        toxprpl_chat_fanout(chat, TOXPRPL_CHAT_CLOSE, NULL, NULL, 0, NULL);
+    }
+    else
+    {
+        toxprpl_friend *friend = toxprpl_friend_find(chat->hub);
+        if (friend != NULL)
+        {
+            toxprpl_chat_send_to(friend, TOXPRPL_CHAT_LEAVE, chat->room,
+                                 NULL, NULL, 0);
+        }
+    }
+    toxprpl_chat_close(chat);
+}
+
+static int toxprpl_chat_send(PurpleConnection *gc, int id,
+                             const char *message, PurpleMessageFlags flags)
+{
+    toxprpl_chat *chat = toxprpl_chat_find(id);
+    gchar key[CLIENT_ID_SIZE * 2 + 1];
+    gsize length = strlen(message);
+    const char *p = message;
+
+    if (chat == NULL)
+    {
+        return -EINVAL;
+    }
+
+    toxprpl_friend *hub = (chat->hub >= 0) ? toxprpl_friend_find(chat->hub) :
+                                             NULL;
+    if ((chat->hub >= 0) && (hub == NULL))
+    {
+        return -ENOTCONN;
+    }
+
+    do
+    {
+        gsize n = toxprpl_chunk_length(p, length, TOXPRPL_CHAT_TEXT_MAX);
+        if (hub == NULL)
+        {
+            toxprpl_chat_fanout(chat, TOXPRPL_CHAT_MSG, self_public_key, p,
+                                n, NULL);
+        }
+        else
+        {
+            int ret = toxprpl_chat_send_to(hub, TOXPRPL_CHAT_MSG, chat->room,
+                                           NULL, p, n);
+            if (ret < 0)
+            {
+                return ret;
+            }
+        }
+        p += n;
+        length -= n;
+    } while (length > 0);
+
+    // libpurple does not echo chat messages
+    toxprpl_tox_bin_id_to_string(self_public_key, key);
+    toxprpl_chat_member *self = toxprpl_chat_member_find(chat, key);
+    serv_got_chat_in(gc, id, (self != NULL) ? self->name :
+                             purple_connection_get_display_name(gc),
+                     PURPLE_MESSAGE_SEND, message, time(NULL));
+    return 0;
+}
+
+static void toxprpl_trace_callback(toxprpl_trace_event event, int fnum,
+                                   guint32 arg, const uint8_t *data,
+                                   uint16_t length)
+{
+    // replayed callbacks are not recorded again
+    if (!g_tox_replaying)
+    {
+        toxprpl_trace_write(g_tox_trace, event, fnum, arg, data, length);
+    }
+}
+
+static void on_friendstatus(int fnum, uint8_t status)
+{
+    purple_debug_info("toxprpl", "Friend status change: %d\n", status);
+    toxprpl_trace_callback(TOXPRPL_TRACE_FRIENDSTATUS, fnum, status, NULL, 0);
+    if (g_tox_gc == NULL)
+    {
+        return;
+    }
+
+    toxprpl_friend *friend = toxprpl_friend_get(fnum);
+    if (friend == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend #%d\n",
+                          fnum);
+        return;
+    }
+
+    gboolean online = (status == FRIEND_ONLINE);
+    if (online == friend->online)
+    {
+        return;
+    }
+
+    toxprpl_friend_online(friend, online);
+    toxprpl_friend_publish(friend);
+}
+
+static void on_request(uint8_t* public_key, uint8_t* data, uint16_t length)
+{
+    gchar buddy_key[CLIENT_ID_SIZE * 2 + 1];
+
+    if (g_tox_trace != NULL)
+    {
+        guint16 size = MIN(CLIENT_ID_SIZE + length, G_MAXUINT16);
+        uint8_t *record = toxprpl_arena_alloc(g_tox_arena, size);
+        memcpy(record, public_key, CLIENT_ID_SIZE);
+        memcpy(record + CLIENT_ID_SIZE, data, size - CLIENT_ID_SIZE);
+        toxprpl_trace_callback(TOXPRPL_TRACE_REQUEST, -1, 0, record, size);
+    }
+
+    if (g_tox_gc == NULL)
+    {
+        return;
+    }
+
+    toxprpl_tox_bin_id_to_string(public_key, buddy_key);
+    gchar *request_msg = toxprpl_arena_strndup(g_tox_arena,
+                                               (const gchar *)data, length);
+    purple_debug_info("toxprpl", "Buddy request from %s: %s\n",
+                      buddy_key, request_msg);
+    if (g_tox_replaying)
+    {
+        // nobody may accept a recorded request, ADD would be for real
+        return;
+    }
+
+    PurpleAccount *account = purple_connection_get_account(g_tox_gc);
+    PurpleBuddy *buddy = purple_find_buddy(account, buddy_key);
+    if (buddy != NULL)
+    {
+        purple_debug_info("toxprpl", "Buddy %s already in buddy list!\n",
+                          buddy_key);
+        return;
+    }
+
+    toxprpl_gateway_emit(g_tox_gateway, "REQ", buddy_key, request_msg);
+    if (toxprpl_headless())
+    {
+        // the bot answers with ADD, no dialog
+        return;
+    }
+
+    gchar *dialog_message = toxprpl_arena_printf(g_tox_arena,
+            "The user %s sendy you a friend request, "
+            "do you want to add him?", buddy_key);
+    purple_request_yes_no(g_tox_gc, "New friend request", dialog_message,
+                          (length > 0) ? request_msg : NULL,
+                          PURPLE_DEFAULT_ACTION_NONE,
+                          purple_connection_get_account(g_tox_gc), NULL,
+                          NULL,
+                          g_strdup(buddy_key), // data, will be freed elsewhere
+                          G_CALLBACK(toxprpl_add_to_buddylist),
+                          G_CALLBACK(toxprpl_do_not_add_to_buddylist));
+}
+
+static void on_incoming_message(int friendnum, uint8_t* string, uint16_t length)
+{
+    purple_debug_info("toxprpl", "Message received!\n");
+    toxprpl_trace_callback(TOXPRPL_TRACE_MESSAGE, friendnum, 0, string, length);
+    if (g_tox_gc == NULL)
+    {
+        return;
+    }
+
+    toxprpl_friend *friend = toxprpl_friend_get(friendnum);
+    if (friend == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnum);
+        return;
+    }
+
+    if (toxprpl_frame_is_frame(string, length))
+    {
+        toxprpl_on_frame(friend, string, length);
+        return;
+    }
+
+    toxprpl_deliver_im(friend, (const char *)string);
+}
+
+static void on_nick_change(int friendnum, uint8_t* data, uint16_t length)
+{
+    purple_debug_info("toxprpl", "Nick change!\n");
+    toxprpl_trace_callback(TOXPRPL_TRACE_NICK, friendnum, 0, data, length);
+
+    if (g_tox_gc == NULL)
+    {
+        return;
+    }
+
+    toxprpl_friend *friend = toxprpl_friend_get(friendnum);
+    if (friend == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnum);
+        return;
+    }
+
+    g_strlcpy(friend->name, (const gchar *)data,
+              MIN(sizeof(friend->name), (gsize)length + 1));
+    if (friend->replay)
+    {
+        // purple_blist_alias_buddy() would store the alias for good
+        toxprpl_presence_set_alias(g_tox_replay_presence, friend->key,
+                                   friend->name);
+        return;
+    }
+
+    PurpleAccount *account = purple_connection_get_account(g_tox_gc);
+    PurpleBuddy *buddy = purple_find_buddy(account, friend->key);
+    if (buddy == NULL)
+    {
+        purple_debug_info("toxprpl", "Ignoring nick change because buddy %s was not found\n", friend->key);
+        return;
+    }
+
+    if (!toxprpl_presence_set_alias(g_tox_presence, friend->key,
+                                    friend->name))
+    {
+        return;
+    }
+
+    toxprpl_gateway_emit(g_tox_gateway, "NICK", friend->key, friend->name);
+    purple_blist_alias_buddy(buddy, friend->name);
+    toxprpl_chat_friend_renamed(friend);
+}
+
+static void on_status_message(int friendnum, uint8_t* data, uint16_t length)
+{
+    toxprpl_trace_callback(TOXPRPL_TRACE_STATUS_MESSAGE, friendnum, 0, data,
+                           length);
+    if (g_tox_gc == NULL)
+    {
+        return;
+    }
+
+    toxprpl_friend *friend = toxprpl_friend_get(friendnum);
+    if (friend == NULL)
+    {
+        return;
+    }
+
+    gchar message[MAX_STATUSMESSAGE_LENGTH + 1];
+    g_strlcpy(message, (const gchar *)data,
+              MIN(sizeof(message), (gsize)length + 1));
+    if (!strcmp(message, friend->status_message))
+    {
+        return;
+    }
+
+    purple_debug_info("toxprpl", "Status message of %s: %s\n", friend->key,
+                      message);
+    strcpy(friend->status_message, message);
+    toxprpl_friend_publish(friend);
+}
+
+static void on_status_change(int friendnum, USERSTATUS userstatus)
+{
+    purple_debug_info("toxprpl", "Status change: %d\n", userstatus);
+    toxprpl_trace_callback(TOXPRPL_TRACE_USERSTATUS, friendnum, userstatus,
+                           NULL, 0);
+    if (g_tox_gc == NULL)
+    {
+        return;
+    }
+
+    toxprpl_friend *friend = toxprpl_friend_get(friendnum);
+    if (friend == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnum);
+        return;
+    }
+
+    friend->userstatus = userstatus;
+    toxprpl_friend_publish(friend);
+}
+
+/*
+ * feeds a recorded callback back into the plugin. The callbacks see the
+ * friends of the replay instead of the live ones while this runs, so the
+ * replay neither disturbs the sessions with the real peers nor sends them
+ * anything.
+ */
+static void toxprpl_replay_dispatch(const toxprpl_trace_record *record)
+{
+    // the callbacks rely on toxcore terminating strings
+    uint8_t *data = (uint8_t *)toxprpl_arena_strndup(g_tox_arena,
+            (const gchar *)record->data, record->length);
+
+    g_tox_replaying = TRUE;
+    switch (record->event)
+    {
+        case TOXPRPL_TRACE_MESSAGE:
+            on_incoming_message(record->fnum, data, record->length);
+            break;
+        case TOXPRPL_TRACE_NICK:
+            on_nick_change(record->fnum, data, record->length);
+            break;
+        case TOXPRPL_TRACE_STATUS_MESSAGE:
+            on_status_message(record->fnum, data, record->length);
+            break;
+        case TOXPRPL_TRACE_USERSTATUS:
+            on_status_change(record->fnum, (USERSTATUS)record->arg);
+            break;
+        case TOXPRPL_TRACE_FRIENDSTATUS:
+            on_friendstatus(record->fnum, (uint8_t)record->arg);
+            break;
+        case TOXPRPL_TRACE_REQUEST:
+            if (record->length >= CLIENT_ID_SIZE)
+            {
+                on_request(data, data + CLIENT_ID_SIZE,
+                           record->length - CLIENT_ID_SIZE);
+            }
+            break;
+        default:
+            purple_debug_info("toxprpl", "Skipping unknown trace event %d\n",
+                              record->event);
+            break;
+    }
+    g_tox_replaying = FALSE;
+    toxprpl_arena_reset(g_tox_arena);
+}
+
+/* drops the replay along with the friends and send queues it made up */
+static void toxprpl_replay_stop(void)
+{
+    toxprpl_replay_free(g_tox_replay);
+    g_tox_replay = NULL;
+    if (g_tox_replay_friends != NULL)
+    {
+        g_hash_table_destroy(g_tox_replay_friends);
+        g_tox_replay_friends = NULL;
+    }
+    toxprpl_sched_free(g_tox_replay_sched);
+    g_tox_replay_sched = NULL;
+    toxprpl_presence_free(g_tox_replay_presence);
+    g_tox_replay_presence = NULL;
+}
+
+static void toxprpl_replay_done(const toxprpl_replay_stats *stats,
+                                gpointer data)
+{
+    gdouble busy = (gdouble)stats->busy / G_USEC_PER_SEC;
+    GString *report = g_string_new(NULL);
+
+    g_string_append_printf(report,
+            _("Callbacks: %u (%u passes)<br>Elapsed: %.3f s<br>"
+              "Busy: %.3f s<br>Throughput: %.0f callbacks/s<br>"
+              "Latency (us): avg %" G_GINT64_FORMAT
+              ", p50 %" G_GINT64_FORMAT ", p99 %" G_GINT64_FORMAT
+              ", max %" G_GINT64_FORMAT),
+            stats->records, stats->passes,
+            (gdouble)stats->elapsed / G_USEC_PER_SEC, busy,
+            (busy > 0) ? stats->records / busy : 0.0,
+            stats->latency_avg, stats->latency_p50, stats->latency_p99,
+            stats->latency_max);
+
+    /*
+     * every pass replays the same events, so once the first one warmed up
+     * arenas, pools and tables the heap has no reason to change. Anything
+     * it still gains over the second half of the run is a leak, no matter
+     * how slow, a few bytes every so many events add up over the passes.
+     */
+    gint64 growth = stats->heap_end - stats->heap_start;
+    const char *verdict = "ok";
+    if ((stats->passes > 1) &&
+        ((stats->heap_start < 0) || (stats->mid_pass == 0)))
+    {
+        // no heap statistics, or too few passes to see a trend
+        verdict = "unchecked";
+    }
+    else if (stats->passes > 1)
+    {
+        gint64 late = stats->heap_end - stats->heap_mid;
+        guint late_records = (guint)((guint64)stats->records *
+                (stats->passes - stats->mid_pass) / stats->passes);
+
+        g_string_append_printf(report,
+                _("<br>Heap growth after the first pass: %" G_GINT64_FORMAT
+                  " bytes, after pass %u: %" G_GINT64_FORMAT " bytes"),
+                growth, stats->mid_pass, late);
+        if (late > 0)
+        {
+            verdict = "leak";
+            purple_debug_error("toxprpl", "Soak run failed, the heap grew by %"
+                               G_GINT64_FORMAT " bytes over the last %u "
+                               "callbacks\n", late, late_records);
+        }
+    }
+
+    purple_debug_info("toxprpl", "Replay finished: %s\n", report->str);
+    if (toxprpl_gateway_client_count(g_tox_gateway) > 0)
+    {
+        gchar *text = g_strdup_printf("%u %u %" G_GINT64_FORMAT " %"
+                G_GINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+                " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %"
+                G_GINT64_FORMAT " %s", stats->records, stats->passes,
+                stats->elapsed, stats->busy, stats->latency_avg,
+                stats->latency_p50, stats->latency_p99, stats->latency_max,
+                (stats->heap_start >= 0) ? growth : 0, verdict);
+        toxprpl_gateway_emit(g_tox_gateway, "REPLAY", NULL, text);
+        g_free(text);
+    }
+    if ((g_tox_gc != NULL) && !toxprpl_headless())
+    {
+        purple_notify_formatted(g_tox_gc, _("Replay"),
+                                !strcmp(verdict, "leak") ?
+                                _("Soak run failed, the heap grew") :
+                                _("Trace replay finished"), NULL, report->str,
+                                NULL, NULL);
+    }
+    g_string_free(report, TRUE);
+
+    toxprpl_replay_stop();
+}
+
+/*
+ * replays a trace recorded with the trace_file account option or the
+ * TOXPRPL_TRACE environment variable. Friend numbers are taken as they
+ * are, so replay against the profile the trace was recorded with.
+ */
+static int toxprpl_replay_start(const char *path, gboolean realtime,
+                                guint passes)
+{
+    if (g_tox_replay != NULL)
+    {
+        return -EBUSY;
+    }
+
+    g_tox_replay = toxprpl_replay_new(path, realtime, passes, g_tox_wheel,
+                                      toxprpl_replay_dispatch,
+                                      toxprpl_replay_done, NULL);
+    if (g_tox_replay == NULL)
+    {
+        return -EINVAL;
+    }
+    g_tox_replay_friends = g_hash_table_new_full(g_direct_hash,
+            g_direct_equal, NULL, toxprpl_friend_free);
+    g_tox_replay_sched = toxprpl_sched_new(toxprpl_replay_transmit);
+    g_tox_replay_presence = toxprpl_presence_load(NULL);
+    return 0;
+}
+
+static gboolean tox_messenger_loop(gpointer data)
+{
+    doMessenger();
+    toxprpl_broadcast_tick();
+    toxprpl_sched_run(g_tox_sched);
+    if (g_tox_replay_sched != NULL)
+    {
+        toxprpl_sched_run(g_tox_replay_sched);
+    }
+    toxprpl_gateway_flush(g_tox_gateway);
+    toxprpl_arena_reset(g_tox_arena);
+    return TRUE;
+}
+
+static gboolean tox_connection_check(gpointer gc)
+{
+    if ((g_connected == 0) && DHT_isconnected())
+    {
+        g_connected = 1;
+        purple_connection_update_progress(gc, _("Connected"),
+                1,   /* which connection step this is */
+                2);  /* total number of steps */
+        purple_connection_set_state(gc, PURPLE_CONNECTED);
+        purple_debug_info("toxprpl", "DHT connected!\n");
+
+        gchar id[CLIENT_ID_SIZE * 2 + 1];
+        toxprpl_tox_bin_id_to_string(self_public_key, id);
+        purple_debug_info("toxprpl", "My ID: %s\n", id);
+
+        // query status of all buddies
+        PurpleAccount *account = purple_connection_get_account(gc);
+        toxprpl_set_status(account, purple_account_get_active_status(account));
+        GSList *buddy_list = purple_find_buddies(account, NULL);
+        g_slist_foreach(buddy_list, toxprpl_query_buddy_status, gc);
+        g_slist_free(buddy_list);
+    }
+    else if ((g_connected == 1) && !DHT_isconnected())
+    {
+        g_connected = 0;
+        purple_debug_info("toxprpl", "DHT not connected!\n");
+        purple_connection_update_progress(gc, _("Connecting"),
+                0,   /* which connection step this is */
+                2);  /* total number of steps */
+    }
+    toxprpl_trace_flush(g_tox_trace);
+    return TRUE;
+}
+/*
+ * helpers
+ */
+/* calls fn for every other live Tox connection, see toxprpl_login() */
+static void foreach_toxprpl_gc(GcFunc fn, PurpleConnection *from,
+        gpointer userdata)
+{
+    GList *l;
+    for (l = g_tox_connections; l != NULL; l = l->next)
+    {
+        fn(from, (PurpleConnection *)l->data, userdata);
+    }
+}
+
+
+// TODO: implement the tox parts
+static void discover_status(PurpleConnection *from, PurpleConnection *to,
+        gpointer userdata) {
+    const char *from_username = from->account->username;
+    const char *to_username = to->account->username;
+
+    purple_debug_info("toxprpl", "discover status from %s to %s\n",
+            from_username, to_username);
+    if (purple_find_buddy(from->account, to_username))
+    {
+        PurpleStatus *status = purple_account_get_active_status(to->account);
+        const char *status_id = purple_status_get_id(status);
+        const char *message = purple_status_get_attr_string(status, "message");
+
+        purple_debug_info("toxprpl", "discover status: status id %s\n",
+                status_id);
+        if (toxprpl_status_index(status) >= 0)
+        {
+            purple_debug_info("toxprpl", "%s sees that %s is %s: %s\n",
+                    from_username, to_username, status_id, message);
+            purple_prpl_got_user_status(from->account, to_username, status_id,
+                    (message) ? "message" : NULL, message, NULL);
+        }
+        else
+        {
+            purple_debug_error("toxprpl",
+                    "%s's buddy %s has an unknown status: %s, %s",
+                    from_username, to_username, status_id, message);
+        }
+    }
+}
+
+// query buddy status
+static void toxprpl_query_buddy_status(gpointer data, gpointer user_data)
+{
+    purple_debug_info("toxprpl", "toxprpl_query_buddy_status\n");
+    PurpleBuddy *buddy = (PurpleBuddy *)data;
+    toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
+    if (buddy_data == NULL)
+    {
+        uint8_t bin_key[CLIENT_ID_SIZE];
+        int fnum = -1;
+        if (toxprpl_tox_hex_string_to_id(buddy->name, bin_key))
+        {
+            fnum = getfriend_id(bin_key);
+        }
+        buddy_data = g_new0(toxprpl_buddy_data, 1);
+        buddy_data->tox_friendlist_number = fnum;
+        purple_buddy_set_protocol_data(buddy, buddy_data);
+    }
+
+    // fill the attribute cache, from here on the callbacks keep it current
+    int fnum = buddy_data->tox_friendlist_number;
+    toxprpl_friend *friend = toxprpl_friend_get(fnum);
+    if (friend == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n", fnum);
+        return;
+    }
+
+    uint8_t name[MAX_NAME_LENGTH];
+    if (getname(fnum, name) == 0)
+    {
+        g_strlcpy(friend->name, (const gchar *)name, sizeof(friend->name));
+        if ((friend->name[0] != '\0') &&
+            toxprpl_presence_set_alias(g_tox_presence, friend->key,
+                                       friend->name))
+        {
+            purple_blist_alias_buddy(buddy, friend->name);
+        }
+    }
+    int size = m_copy_statusmessage(fnum, (uint8_t *)friend->status_message,
+                                    MAX_STATUSMESSAGE_LENGTH);
+    friend->status_message[CLAMP(size, 0, MAX_STATUSMESSAGE_LENGTH)] = '\0';
+    friend->userstatus = m_get_userstatus(fnum);
+    gboolean online = (m_friendstatus(fnum) == FRIEND_ONLINE);
+    if (online != friend->online)
+    {
+        toxprpl_friend_online(friend, online);
+    }
+    toxprpl_friend_publish(friend);
+}
+
+static void report_status_change(PurpleConnection *from, PurpleConnection *to,
+        gpointer userdata)
+{
+    purple_debug_info("toxprpl", "notifying %s that %s changed status\n",
+            to->account->username, from->account->username);
+    discover_status(to, from, NULL);
+}
+
+
+/*
+ * UI callbacks
+ */
+static void toxprpl_input_user_info(PurplePluginAction *action)
+{
+    PurpleConnection *gc = (PurpleConnection *)action->context;
+    PurpleAccount *acct = purple_connection_get_account(gc);
+    purple_debug_info("toxprpl", "showing 'Set User Info' dialog for %s\n",
+            acct->username);
+
+    purple_account_request_change_user_info(acct);
+}
+
+static void toxprpl_broadcast_cb(gpointer data, const char *message)
+{
+    PurpleConnection *gc = (PurpleConnection *)data;
+    if ((gc != g_tox_gc) || (message == NULL) || (*message == '\0'))
+    {
+        return;
+    }
+
+    if (toxprpl_broadcast_to_buddies(message, NULL) < 0)
+    {
+        purple_notify_error(gc, _("Error"),
+                            _("Could not start the broadcast"), NULL);
+    }
+}
+
+static void toxprpl_replay_cb(gpointer data, PurpleRequestFields *fields)
+{
+    PurpleConnection *gc = (PurpleConnection *)data;
+    const char *path = purple_request_fields_get_string(fields, "path");
+    gboolean realtime = purple_request_fields_get_bool(fields, "realtime");
+    int passes = purple_request_fields_get_integer(fields, "passes");
+
+    if ((gc != g_tox_gc) || (path == NULL) || (*path == '\0'))
+    {
+        return;
+    }
+
+    int ret = toxprpl_replay_start(path, realtime, MAX(passes, 1));
+    if (ret < 0)
+    {
+        purple_notify_error(gc, _("Error"),
+                            (ret == -EBUSY) ?
+                                _("A replay is already running") :
+                                _("Could not read the trace"), path);
+    }
+}
+
+static void toxprpl_input_replay(PurplePluginAction *action)
+{
+    PurpleConnection *gc = (PurpleConnection *)action->context;
+    PurpleAccount *acct = purple_connection_get_account(gc);
+    PurpleRequestFields *fields = purple_request_fields_new();
+    PurpleRequestFieldGroup *group = purple_request_field_group_new(NULL);
+
+    purple_request_field_group_add_field(group,
+            purple_request_field_string_new("path", _("Trace file"), NULL,
+                                            FALSE));
+    purple_request_field_group_add_field(group,
+            purple_request_field_bool_new("realtime",
+                                          _("Keep the recorded timing"),
+                                          FALSE));
+    // more than one pass is a soak run, see toxprpl_replay_done()
+    purple_request_field_group_add_field(group,
+            purple_request_field_int_new("passes", _("Passes"), 1));
+    purple_request_fields_add_group(fields, group);
+
+    purple_request_fields(gc, _("Replay"), _("Replay a callback trace"),
+                          _("Recorded callbacks are fed into this "
+                            "connection, nothing is sent to the peers."),
+                          fields,
+                          _("Replay"), G_CALLBACK(toxprpl_replay_cb),
+                          _("Cancel"), NULL,
+                          acct, NULL, NULL, gc);
+}
+
+static void toxprpl_show_lanes(PurplePluginAction *action)
+{
+    PurpleConnection *gc = (PurpleConnection *)action->context;
+    GString *report = g_string_new(NULL);
+    toxprpl_lane lane;
+
+    for (lane = 0; lane < TOXPRPL_LANES; lane++)
+    {
+        toxprpl_lane_stats stats;
+        toxprpl_sched_stats(g_tox_sched, lane, &stats);
+        g_string_append_printf(report,
+                _("<b>%s</b>: %u queued (%" G_GSIZE_FORMAT " bytes), "
+                  "%" G_GUINT64_FORMAT " sent, %" G_GUINT64_FORMAT
+                  " dropped<br>wait (ms): avg %.1f, max %.1f, "
+                  "oldest %.1f<br>"),
+                toxprpl_lane_name(lane), stats.depth, stats.bytes,
+                stats.sent, stats.dropped, stats.wait_avg / 1000.0,
+                stats.wait_max / 1000.0, stats.oldest / 1000.0);
+    }
+
+    purple_notify_formatted(gc, _("Send Queues"),
+                            _("Outbound lane statistics"), NULL, report->str,
+                            NULL, NULL);
+    g_string_free(report, TRUE);
+}
+
+static void toxprpl_input_broadcast(PurplePluginAction *action)
+{
+    PurpleConnection *gc = (PurpleConnection *)action->context;
+    PurpleAccount *acct = purple_connection_get_account(gc);
+
+    purple_request_input(gc, _("Broadcast"),
+                         _("Send a message to all buddies"), NULL, NULL,
+                         TRUE, FALSE, NULL,
+                         _("Send"), G_CALLBACK(toxprpl_broadcast_cb),
+                         _("Cancel"), NULL,
+                         acct, NULL, NULL, gc);
+}
+
+/* this is set to the actions member of the PurplePluginInfo struct at the
+ * bottom.
+ */
+static GList *toxprpl_actions(PurplePlugin *plugin, gpointer context)
+{
+    PurplePluginAction *action = purple_plugin_action_new(
+            _("Set User Info..."), toxprpl_input_user_info);
+    GList *actions = g_list_append(NULL, action);
+
+    action = purple_plugin_action_new(_("Broadcast Message..."),
+                                      toxprpl_input_broadcast);
+    actions = g_list_append(actions, action);
+
+    action = purple_plugin_action_new(_("Replay Trace..."),
+                                      toxprpl_input_replay);
+    actions = g_list_append(actions, action);
+
+    action = purple_plugin_action_new(_("Send Queue Statistics..."),
+                                      toxprpl_show_lanes);
+    return g_list_append(actions, action);
+}
+
+
+static const char *toxprpl_list_icon(PurpleAccount *acct, PurpleBuddy *buddy)
+{
+    return "null";
+}
+
+/* img is NULL if the icon was removed */
+static void toxprpl_set_buddy_icon(PurpleConnection *gc,
+                                   PurpleStoredImage *img)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    if (g_tox_icon != NULL)
+    {
+        g_bytes_unref(g_tox_icon);
+        g_tox_icon = NULL;
+    }
+
+    if (img != NULL)
+    {
+        gconstpointer data = purple_imgstore_get_data(img);
+        gsize size = purple_imgstore_get_size(img);
+        g_tox_icon = g_bytes_new(data, size);
+        toxprpl_icon_hash(data, size, g_tox_icon_hash);
+        purple_debug_info("toxprpl", "Using an icon of %" G_GSIZE_FORMAT
+                          " bytes\n", size);
+    }
+
+    if (g_tox_friends == NULL)
+    {
+        return;
+    }
+
+    // only the hash is sent, peers fetch the icon if they do not have it
+    g_hash_table_iter_init(&iter, g_tox_friends);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_friend *friend = (toxprpl_friend *)value;
+        if (friend->session_ready && (friend->peer_caps & TOXPRPL_CAP_ICONS))
+        {
+            toxprpl_icon_announce(friend);
+        }
+    }
+}
+
+static GList *toxprpl_status_types(PurpleAccount *acct)
+{
+    GList *types = NULL;
+    PurpleStatusType *type;
+    int i;
+
+    purple_debug_info("toxprpl", "setting up status types\n");
+
+    for (i = 0; i < TOXPRPL_MAX_STATUSES; i++)
+    {
+        type = purple_status_type_new_with_attrs(toxprpl_statuses[i].primitive,
+            toxprpl_statuses[i].id, toxprpl_statuses[i].title, TRUE, TRUE,
+            FALSE,
+            "message", _("Message"), purple_value_new(PURPLE_TYPE_STRING),
+            NULL);
+        types = g_list_append(types, type);
+    }
+
+    return types;
+}
+
+
+static void toxprpl_add_escaped_pair(PurpleNotifyUserInfo *user_info,
+                                     const char *label, const char *value)
+{
+    gchar *escaped = g_markup_escape_text(value, -1);
+    purple_notify_user_info_add_pair(user_info, label, escaped);
+    g_free(escaped);
+}
+
+static void toxprpl_add_last_seen(PurpleNotifyUserInfo *user_info,
+                                  toxprpl_friend *friend)
+{
+    if (friend->online || (friend->last_seen == 0))
+    {
+        return;
+    }
+    purple_notify_user_info_add_pair(user_info, _("Last seen"),
+            purple_date_format_full(localtime(&friend->last_seen)));
+}
+
+/* the blist hooks below only read the attribute cache */
+static char *toxprpl_status_text(PurpleBuddy *buddy)
+{
+    toxprpl_friend *friend = toxprpl_friend_find_buddy(buddy);
+    if (friend == NULL)
+    {
+        // not connected yet, show what the last session knew
+        toxprpl_presence *presence = toxprpl_presence_find(g_tox_presence,
+                                                           buddy->name);
+        if ((presence == NULL) || (presence->message == NULL))
+        {
+            return NULL;
+        }
+        return g_markup_escape_text(presence->message, -1);
+    }
+    if (friend->status_message[0] == '\0')
+    {
+        return NULL;
+    }
+    return g_markup_escape_text(friend->status_message, -1);
+}
+
+static void toxprpl_tooltip_text(PurpleBuddy *buddy,
+                                 PurpleNotifyUserInfo *user_info,
+                                 gboolean full)
+{
+    toxprpl_friend *friend = toxprpl_friend_find_buddy(buddy);
+    if (friend == NULL)
+    {
+        toxprpl_presence *presence = toxprpl_presence_find(g_tox_presence,
+                                                           buddy->name);
+        if ((presence == NULL) || !presence->stale)
+        {
+            return;
+        }
+        if (presence->message != NULL)
+        {
+            toxprpl_add_escaped_pair(user_info, _("Message"),
+                                     presence->message);
+        }
+        purple_notify_user_info_add_pair(user_info, _("Presence"),
+                _("Last known, not confirmed yet"));
+        return;
+    }
+
+    if (friend->name[0] != '\0')
+    {
+        toxprpl_add_escaped_pair(user_info, _("Name"), friend->name);
+    }
+    if (friend->status_message[0] != '\0')
+    {
+        toxprpl_add_escaped_pair(user_info, _("Message"),
+                                 friend->status_message);
+    }
+    if (full)
+    {
+        toxprpl_add_last_seen(user_info, friend);
+    }
+}
+
+static void toxprpl_get_info(PurpleConnection *gc, const char *who)
+{
+    PurpleAccount *account = purple_connection_get_account(gc);
+    PurpleBuddy *buddy = purple_find_buddy(account, who);
+    toxprpl_friend *friend = NULL;
+
+    if (buddy != NULL)
+    {
+        friend = toxprpl_friend_find_buddy(buddy);
+    }
+
+    PurpleNotifyUserInfo *user_info = purple_notify_user_info_new();
+    purple_notify_user_info_add_pair(user_info, _("Tox ID"), who);
+    if (friend != NULL)
+    {
+        if (friend->name[0] != '\0')
+        {
+            toxprpl_add_escaped_pair(user_info, _("Name"), friend->name);
+        }
+        purple_notify_user_info_add_pair(user_info, _("Status"),
+                toxprpl_statuses[friend->status_index].title);
+        if (friend->status_message[0] != '\0')
+        {
+            toxprpl_add_escaped_pair(user_info, _("Message"),
+                                     friend->status_message);
+        }
+        purple_notify_user_info_add_pair(user_info, _("Connection"),
+                friend->online ? _("Connected") : _("Not connected"));
+        toxprpl_add_last_seen(user_info, friend);
+    }
+    else
+    {
+        purple_notify_user_info_add_pair(user_info, _("Status"),
+                                         _("Unknown"));
+    }
+
+    purple_notify_userinfo(gc, who, user_info, NULL, NULL);
+    purple_notify_user_info_destroy(user_info);
+}
+
+/* only talks to toxcore about what actually changed */
+static void toxprpl_set_status(PurpleAccount *account, PurpleStatus *status)
+{
+    int index = toxprpl_status_index(status);
+    if ((index < 0) || (index == TOXPRPL_STATUS_OFFLINE))
+    {
+        return;
+    }
+
+    if (index != g_tox_self_status_index)
+    {
+        USERSTATUS userstatus = USERSTATUS_NONE;
+        if (index == TOXPRPL_STATUS_AWAY)
+        {
+            userstatus = USERSTATUS_AWAY;
+        }
+        else if (index == TOXPRPL_STATUS_BUSY)
+        {
+            userstatus = USERSTATUS_BUSY;
+        }
+
+        purple_debug_info("toxprpl", "Setting own status to %s\n",
+                          toxprpl_statuses[index].id);
+        if (m_set_userstatus(userstatus) >= 0)
+        {
+            g_tox_self_status_index = index;
+        }
+    }
+
+    const char *attr = purple_status_get_attr_string(status, "message");
+    gchar *message = purple_markup_strip_html(attr ? attr : "");
+    // never send half a character to our friends
+    message[toxprpl_chunk_length(message, strlen(message),
+                                 MAX_STATUSMESSAGE_LENGTH - 1)] = '\0';
+
+    if ((g_tox_self_status_message != NULL) &&
+        !strcmp(message, g_tox_self_status_message))
+    {
+        g_free(message);
+        return;
+    }
+
+    purple_debug_info("toxprpl", "Setting own status message to %s\n",
+                      message);
+    if (m_set_statusmessage((uint8_t *)message, strlen(message) + 1) >= 0)
+    {
+        g_free(g_tox_self_status_message);
+        g_tox_self_status_message = message;
+    }
+    else
+    {
+        g_free(message);
+    }
+}
+
+/* returns FALSE if hex_string is not a valid client id */
+static gboolean toxprpl_tox_hex_string_to_id(const char *hex_string,
+                                             uint8_t *bin_id)
+{
+    int i;
+
+    if (strlen(hex_string) != CLIENT_ID_SIZE * 2)
+    {
+        return FALSE;
     }
-    else if ((g_connected == 1) && !DHT_isconnected())
+
+    for (i = 0; i < CLIENT_ID_SIZE; i++)
     {
-        g_connected = 0;
-        purple_debug_info("toxprpl", "DHT not connected!\n");
-        purple_connection_update_progress(gc, _("Connecting"),
-                0,   /* which connection step this is */
-                2);  /* total number of steps */
+        int hi = g_ascii_xdigit_value(hex_string[i * 2]);
+        int lo = g_ascii_xdigit_value(hex_string[i * 2 + 1]);
+        if ((hi < 0) || (lo < 0))
+        {
+            return FALSE;
+        }
+        bin_id[i] = (hi << 4) | lo;
     }
     return TRUE;
 }
+
 /*
- * helpers
+ * toxcore is only set up when a Tox account logs in for the first time, so
+ * clients without an enabled Tox account do not pay for it
  */
-static PurpleConnection *get_toxprpl_gc(const char *username)
+static void toxprpl_tox_init(void)
 {
-    PurpleAccount *acct = purple_accounts_find(username, TOXPRPL_ID);
-    if (acct && purple_account_is_connected(acct))
-        return acct->gc;
-    else
-        return NULL;
+    if (!g_tox_initialized)
+    {
+        purple_debug_info("toxprpl", "initializing tox\n");
+        initMessenger();
+        m_callback_friendmessage(on_incoming_message);
+        m_callback_namechange(on_nick_change);
+        m_callback_userstatus(on_status_change);
+        m_callback_statusmessage(on_status_message);
+        m_callback_friendrequest(on_request);
+        m_callback_friendstatus(on_friendstatus);
+        purple_debug_info("toxprpl", "initialized tox callbacks\n");
+
+        const char *msg64 = purple_prefs_get_string(
+                "/plugins/prpl/tox/messenger");
+        if ((msg64 != NULL) && (*msg64 != '\0'))
+        {
+            purple_debug_info("toxprpl", "found preference data\n");
+            gsize out_len;
+            guchar *msg_data = g_base64_decode(msg64, &out_len);
+            if (msg_data && (out_len > 0))
+            {
+                Messenger_load((uint8_t *)msg_data, (uint32_t)out_len);
+            }
+            g_free(msg_data);
+        }
+        g_tox_initialized = TRUE;
+    }
+
+    g_tox_wheel = toxprpl_wheel_new(TOXPRPL_WHEEL_RESOLUTION);
+    g_tox_arena = toxprpl_arena_new(TOXPRPL_ARENA_SIZE);
+    g_tox_sched = toxprpl_sched_new(toxprpl_sched_transmit);
+    g_tox_chats = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                        (GDestroyNotify)toxprpl_chat_free);
+    g_tox_chat_rooms = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                             g_free, NULL);
+    g_tox_friends = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                          NULL, toxprpl_friend_free);
+    // peers reset their receive state when they see a new epoch
+    g_tox_epoch = g_random_int();
 }
 
-static void call_if_toxprpl(gpointer data, gpointer userdata)
+static void toxprpl_tox_save(void)
 {
-    PurpleConnection *gc = (PurpleConnection *)(data);
-    GcFuncData *gcfdata = (GcFuncData *)userdata;
+    uint32_t msg_size = Messenger_size();
+    guchar *msg_data = g_malloc0(msg_size);
+    Messenger_save((uint8_t *)msg_data);
 
-    if (!strcmp(gc->account->protocol_id, TOXPRPL_ID))
-        gcfdata->fn(gcfdata->from, gc, gcfdata->userdata);
+    gchar *msg64 = g_base64_encode(msg_data, msg_size);
+    purple_prefs_set_string("/plugins/prpl/tox/messenger", msg64);
+    g_free(msg64);
+    g_free(msg_data);
 }
 
-static void foreach_toxprpl_gc(GcFunc fn, PurpleConnection *from,
-        gpointer userdata)
+/* periodic checkpoint, so a crash does not lose friends added meanwhile */
+static gboolean toxprpl_tox_checkpoint(gpointer data)
 {
-    GcFuncData gcfdata = { fn, from, userdata };
-    g_list_foreach(purple_connections_get_all(), call_if_toxprpl,
-            &gcfdata);
+    toxprpl_tox_save();
+    return TRUE;
 }
 
-
-typedef void(*ChatFunc)(PurpleConvChat *from, PurpleConvChat *to,
-        int id, const char *room, gpointer userdata);
-
-typedef struct
+static gboolean toxprpl_presence_checkpoint(gpointer data)
 {
-    ChatFunc fn;
-    PurpleConvChat *from_chat;
-    gpointer userdata;
-} ChatFuncData;
+    toxprpl_presence_save(g_tox_presence);
+    return TRUE;
+}
 
-static void call_chat_func(gpointer data, gpointer userdata)
+/* applies one snapshot entry, drops the ones of buddies that are gone */
+static gboolean toxprpl_presence_restore_one(gpointer key, gpointer value,
+                                             gpointer data)
 {
-    PurpleConnection *to = (PurpleConnection *)data;
-    ChatFuncData *cfdata = (ChatFuncData *)userdata;
+    PurpleAccount *account = (PurpleAccount *)data;
+    toxprpl_presence *presence = (toxprpl_presence *)value;
+    PurpleBuddy *buddy = purple_find_buddy(account, key);
 
-    int id = cfdata->from_chat->id;
-    PurpleConversation *conv = purple_find_chat(to, id);
-    if (conv)
+    if ((buddy == NULL) || (presence->status >= TOXPRPL_MAX_STATUSES))
     {
-        PurpleConvChat *chat = purple_conversation_get_chat_data(conv);
-        cfdata->fn(cfdata->from_chat, chat, id, conv->name, cfdata->userdata);
+        return TRUE;
     }
-}
-
-static void foreach_gc_in_chat(ChatFunc fn, PurpleConnection *from,
-        int id, gpointer userdata)
-{
-    PurpleConversation *conv = purple_find_chat(from, id);
-    ChatFuncData cfdata = { fn,
-        purple_conversation_get_chat_data(conv),
-        userdata };
-
-    g_list_foreach(purple_connections_get_all(), call_chat_func,
-            &cfdata);
-}
 
-// TODO: implement the tox parts
-static void discover_status(PurpleConnection *from, PurpleConnection *to,
-        gpointer userdata) {
-    const char *from_username = from->account->username;
-    const char *to_username = to->account->username;
-
-    purple_debug_info("toxprpl", "discover status from %s to %s\n",
-            from_username, to_username);
-    if (purple_find_buddy(from->account, to_username))
+    if ((presence->alias != NULL) &&
+        (g_strcmp0(presence->alias, buddy->alias) != 0))
     {
-        PurpleStatus *status = purple_account_get_active_status(to->account);
-        const char *status_id = purple_status_get_id(status);
-        const char *message = purple_status_get_attr_string(status, "message");
-
-        purple_debug_info("toxprpl", "discover status: status id %s\n",
-                status_id);
-        if (!strcmp(status_id, toxprpl_statuses[TOXPRPL_STATUS_ONLINE].id) ||
-                !strcmp(status_id, toxprpl_statuses[TOXPRPL_STATUS_AWAY].id) ||
-                !strcmp(status_id, toxprpl_statuses[TOXPRPL_STATUS_BUSY].id) ||
-                !strcmp(status_id, toxprpl_statuses[TOXPRPL_STATUS_OFFLINE].id))
+        purple_blist_alias_buddy(buddy, presence->alias);
+    }
+    // buddies start out offline anyway
+    if (presence->status != TOXPRPL_STATUS_OFFLINE)
+    {
+        const char *status_id = toxprpl_statuses[presence->status].id;
+        if (presence->message != NULL)
         {
-            purple_debug_info("toxprpl", "%s sees that %s is %s: %s\n",
-                    from_username, to_username, status_id, message);
-            purple_prpl_got_user_status(from->account, to_username, status_id,
-                    (message) ? "message" : NULL, message, NULL);
+            purple_prpl_got_user_status(account, key, status_id,
+                                        "message", presence->message, NULL);
         }
         else
         {
-            purple_debug_error("toxprpl",
-                    "%s's buddy %s has an unknown status: %s, %s",
-                    from_username, to_username, status_id, message);
+            purple_prpl_got_user_status(account, key, status_id, NULL);
         }
     }
+    return FALSE;
 }
 
-// query buddy status
-static void toxprpl_query_buddy_status(gpointer data, gpointer user_data)
+/*
+ * shows the presence of the last session in one pass right after login,
+ * tox_connection_check() confirms or corrects each entry once the DHT is up
+ */
+static void toxprpl_presence_restore(PurpleAccount *account)
 {
-    purple_debug_info("toxprpl", "toxprpl_query_buddy_status\n");
-    PurpleBuddy *buddy = (PurpleBuddy *)data;
-    PurpleConnection *gc = (PurpleConnection *)user_data;
-    unsigned char *bin_key = toxprpl_tox_hex_string_to_id(buddy->name);
-    toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
-    if (buddy_data == NULL)
-    {
-        int fnum = getfriend_id(bin_key);
-        buddy_data = g_new0(toxprpl_buddy_data, 1);
-        buddy_data->tox_friendlist_number = fnum;
-        purple_buddy_set_protocol_data(buddy, buddy_data);
-    }
-
-    PurpleAccount *account = purple_connection_get_account(gc);
-    purple_debug_info("toxprpl", "Setting user status for user %s to %s\n",
-        buddy->name, toxprpl_statuses[toxprpl_get_status_index(
-            buddy_data->tox_friendlist_number,
-            m_get_userstatus(buddy_data->tox_friendlist_number))].id);
-    purple_prpl_got_user_status(account, buddy->name,
-        toxprpl_statuses[toxprpl_get_status_index(
-            buddy_data->tox_friendlist_number,
-            m_get_userstatus(buddy_data->tox_friendlist_number))].id,
-        NULL);
-    g_free(bin_key);
-}
+    gchar *path = g_build_filename(purple_user_dir(), "tox_presence", NULL);
+    g_tox_presence = toxprpl_presence_load(path);
+    g_free(path);
 
-static void report_status_change(PurpleConnection *from, PurpleConnection *to,
-        gpointer userdata)
-{
-    purple_debug_info("toxprpl", "notifying %s that %s changed status\n",
-            to->account->username, from->account->username);
-    discover_status(to, from, NULL);
+    toxprpl_presence_foreach_remove(g_tox_presence,
+                                    toxprpl_presence_restore_one, account);
 }
 
-
 /*
- * UI callbacks
+ * stops everything that toxprpl_login() started and releases all per
+ * login state. The old toxcore API has no way to release the messenger
+ * itself, it stays around (idle) and is reused by the next login.
  */
-static void toxprpl_input_user_info(PurplePluginAction *action)
+static void toxprpl_tox_teardown(void)
 {
-    PurpleConnection *gc = (PurpleConnection *)action->context;
-    PurpleAccount *acct = purple_connection_get_account(gc);
-    purple_debug_info("toxprpl", "showing 'Set User Info' dialog for %s\n",
-            acct->username);
+    GList *link;
 
-    purple_account_request_change_user_info(acct);
-}
+    if (!g_logged_in)
+    {
+        return;
+    }
 
-/* this is set to the actions member of the PurplePluginInfo struct at the
- * bottom.
- */
-static GList *toxprpl_actions(PurplePlugin *plugin, gpointer context)
-{
-    PurplePluginAction *action = purple_plugin_action_new(
-            _("Set User Info..."), toxprpl_input_user_info);
-    return g_list_append(NULL, action);
-}
+    purple_debug_info("toxprpl", "tearing down\n");
+    toxprpl_tox_save();
 
+    toxprpl_replay_stop();
+    toxprpl_trace_close(g_tox_trace);
+    g_tox_trace = NULL;
 
-static const char *toxprpl_list_icon(PurpleAccount *acct, PurpleBuddy *buddy)
-{
-    return "null";
-}
+    toxprpl_presence_save(g_tox_presence);
+    toxprpl_presence_free(g_tox_presence);
+    g_tox_presence = NULL;
 
-static GList *toxprpl_status_types(PurpleAccount *acct)
-{
-    GList *types = NULL;
-    PurpleStatusType *type;
-    int i;
+    toxprpl_broadcast_free_all();
+    g_hash_table_destroy(g_tox_chat_rooms);
+    g_tox_chat_rooms = NULL;
+    g_hash_table_destroy(g_tox_chats);
+    g_tox_chats = NULL;
+    toxprpl_gateway_free(g_tox_gateway);
+    g_tox_gateway = NULL;
 
-    purple_debug_info("toxprpl", "setting up status types\n");
+    g_hash_table_destroy(g_tox_friends);
+    g_tox_friends = NULL;
+    toxprpl_sched_free(g_tox_sched);
+    g_tox_sched = NULL;
 
-    for (i = 0; i < TOXPRPL_MAX_STATUSES; i++)
+    // cancels whatever is still pending, including the messenger tick
+    toxprpl_wheel_free(g_tox_wheel);
+    g_tox_wheel = NULL;
+    toxprpl_arena_free(g_tox_arena);
+    g_tox_arena = NULL;
+
+    g_free(g_tox_self_status_message);
+    g_tox_self_status_message = NULL;
+    if (g_tox_icon != NULL)
     {
-        type = purple_status_type_new_with_attrs(toxprpl_statuses[i].primitive,
-            toxprpl_statuses[i].id, toxprpl_statuses[i].title, TRUE, TRUE,
-            FALSE,
-            "message", _("Message"), purple_value_new(PURPLE_TYPE_STRING),
-            NULL);
-        types = g_list_append(types, type);
+        g_bytes_unref(g_tox_icon);
+        g_tox_icon = NULL;
     }
-
-    return types;
-}
-
-static unsigned char *toxprpl_tox_hex_string_to_id(const char *hex_string)
-{
-    int i;
-    size_t len = strlen(hex_string);
-    unsigned char *bin = malloc(len);
-    if (bin == NULL)
+    if (g_tox_packed_in != NULL)
     {
-        return NULL;
+        g_bytes_unref(g_tox_packed_in);
+        g_tox_packed_in = NULL;
     }
-    const char *p = hex_string;
-    for (i = 0; i < len; i++)
+    g_tox_packed_length = 0;
+    while ((link = g_queue_pop_head_link(&g_tox_tx_spare)) != NULL)
     {
-        sscanf(p, "%2hhx", &bin[i]);
-        p = p + 2;
+        g_free(link->data);
     }
-    return bin;
+    toxprpl_compress_cleanup();
+    g_tox_self_status_index = -1;
+
+    g_tox_gc = NULL;
+    g_connected = 0;
+    g_logged_in = 0;
 }
 
 static void toxprpl_login(PurpleAccount *acct)
 {
     IP_Port dht;
 
+    g_tox_connections = g_list_prepend(g_tox_connections,
+                                       purple_account_get_connection(acct));
+
     purple_debug_info("toxprpl", "logging in %d\n", g_logged_in);
     if (g_logged_in)
     {
@@ -602,6 +4307,15 @@ static void toxprpl_login(PurpleAccount *acct)
     g_tox_gc = gc;
 
     purple_debug_info("toxprpl", "logging in %s\n", acct->username);
+    toxprpl_tox_init();
+    toxprpl_presence_restore(acct);
+
+    PurpleStoredImage *icon = purple_buddy_icons_find_account_icon(acct);
+    toxprpl_set_buddy_icon(gc, icon);
+    if (icon != NULL)
+    {
+        purple_imgstore_unref(icon);
+    }
 
     purple_connection_update_progress(gc, _("Connecting"),
             0,   /* which connection step this is */
@@ -616,32 +4330,68 @@ static void toxprpl_login(PurpleAccount *acct)
                                           DEFAULT_SERVER_KEY);
     uint32_t resolved = resolve_addr(ip);
     dht.ip.i = resolved;
-    unsigned char *bin_str = toxprpl_tox_hex_string_to_id(key);
-    DHT_bootstrap(dht, bin_str);
-    free(bin_str);
+    uint8_t bin_key[CLIENT_ID_SIZE];
+    if (toxprpl_tox_hex_string_to_id(key, bin_key))
+    {
+        DHT_bootstrap(dht, bin_key);
+    }
+    else
+    {
+        purple_debug_error("toxprpl", "Invalid server key %s\n", key);
+    }
     purple_debug_info("toxprpl", "Will connect to %s:%d (%s)\n" ,
                       ip, DEFAULT_SERVER_PORT, key);
-    g_tox_messenger_timer = purple_timeout_add(100, tox_messenger_loop, NULL);
-    purple_debug_info("toxprpl", "added messenger timer as %d\n", g_tox_messenger_timer);
-    g_tox_connection_timer = purple_timeout_add_seconds(2, tox_connection_check,
-                                                        gc);
+    toxprpl_wheel_add(g_tox_wheel, TOXPRPL_MESSENGER_INTERVAL,
+                      TOXPRPL_MESSENGER_INTERVAL, tox_messenger_loop, NULL);
+    toxprpl_wheel_add(g_tox_wheel, TOXPRPL_CONNECTION_INTERVAL,
+                      TOXPRPL_CONNECTION_INTERVAL, tox_connection_check, gc);
+    toxprpl_wheel_add(g_tox_wheel, TOXPRPL_CHECKPOINT_INTERVAL,
+                      TOXPRPL_CHECKPOINT_INTERVAL, toxprpl_tox_checkpoint,
+                      NULL);
+    toxprpl_wheel_add(g_tox_wheel, TOXPRPL_PRESENCE_INTERVAL,
+                      TOXPRPL_PRESENCE_INTERVAL, toxprpl_presence_checkpoint,
+                      NULL);
+
+    // the environment wins, so a trace can be taken without touching the
+    // account
+    const char *trace_path = g_getenv("TOXPRPL_TRACE");
+    if ((trace_path == NULL) || (*trace_path == '\0'))
+    {
+        trace_path = purple_account_get_string(acct, "trace_file", "");
+    }
+    if ((trace_path != NULL) && (*trace_path != '\0'))
+    {
+        g_tox_trace = toxprpl_trace_open(trace_path);
+    }
+
+    g_tox_headless = purple_account_get_bool(acct, "headless", FALSE);
+    const char *socket_path = purple_account_get_string(acct,
+                                                        "gateway_socket", "");
+    if ((socket_path != NULL) && (*socket_path != '\0'))
+    {
+        g_tox_gateway = toxprpl_gateway_new(socket_path,
+                                            &toxprpl_gateway_callbacks);
+    }
 }
 
 static void toxprpl_close(PurpleConnection *gc)
 {
     /* notify other toxprpl accounts */
     purple_debug_info("toxprpl", "Closing!\n");
+    g_tox_connections = g_list_remove(g_tox_connections, gc);
     foreach_toxprpl_gc(report_status_change, gc, NULL);
+
+    // a second Tox account never got past toxprpl_login(), see README
+    if (gc == g_tox_gc)
+    {
+        toxprpl_tox_teardown();
+    }
 }
 
 static int toxprpl_send_im(PurpleConnection *gc, const char *who,
         const char *message, PurpleMessageFlags flags)
 {
     const char *from_username = gc->account->username;
-    PurpleMessageFlags receive_flags = ((flags & ~PURPLE_MESSAGE_SEND)
-            | PURPLE_MESSAGE_RECV);
-    PurpleAccount *to_acct = purple_accounts_find(who, TOXPRPL_ID);
-    PurpleConnection *to;
 
     purple_debug_info("toxprpl", "sending message from %s to %s: %s\n",
             from_username, who, message);
@@ -661,50 +4411,135 @@ static int toxprpl_send_im(PurpleConnection *gc, const char *who,
         return 0;
     }
 
-    m_sendmessage(buddy_data->tox_friendlist_number, (uint8_t *)message,
-                  strlen(message)+1);
-    return 1;
+    toxprpl_friend *friend = toxprpl_friend_get(
+            buddy_data->tox_friendlist_number);
+    if (friend != NULL)
+    {
+        // the peer stops showing us as typing when the message arrives
+        friend->tx_typing = TOXPRPL_TYPING_NONE;
+    }
+    if ((friend != NULL) && (friend->peer_caps & TOXPRPL_CAP_RECEIPTS))
+    {
+        return toxprpl_reliable_send(friend, message);
+    }
+
+    return toxprpl_send_plain(buddy_data->tox_friendlist_number, message,
+                              NULL, NULL);
+}
+
+/*
+ * UIs call this as often as every keystroke, only changes of the state go
+ * out right away and a lasting state is repeated at most every
+ * TOXPRPL_TYPING_REFRESH seconds
+ */
+static unsigned int toxprpl_send_typing(PurpleConnection *gc,
+                                        const char *name,
+                                        PurpleTypingState state)
+{
+    PurpleAccount *account = purple_connection_get_account(gc);
+    PurpleBuddy *buddy = purple_find_buddy(account, name);
+    toxprpl_friend *friend = (buddy != NULL) ?
+                             toxprpl_friend_find_buddy(buddy) : NULL;
+    if ((friend == NULL) || !friend->session_ready ||
+        !(friend->peer_caps & TOXPRPL_CAP_TYPING))
+    {
+        return 0;
+    }
+
+    guint8 typing;
+    switch (state)
+    {
+        case PURPLE_TYPING:
+            typing = TOXPRPL_TYPING_ACTIVE;
+            break;
+        case PURPLE_TYPED:
+            typing = TOXPRPL_TYPING_PAUSED;
+            break;
+        default:
+            typing = TOXPRPL_TYPING_NONE;
+            break;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    if ((typing == friend->tx_typing) &&
+        ((typing == TOXPRPL_TYPING_NONE) ||
+         ((now - friend->tx_typing_at) <
+          TOXPRPL_TYPING_REFRESH * G_USEC_PER_SEC)))
+    {
+        return (typing != TOXPRPL_TYPING_NONE) ? TOXPRPL_TYPING_REFRESH : 0;
+    }
+
+    // a state still waiting in the control lane is outdated by this one
+    toxprpl_sched_cancel(toxprpl_friend_sched(friend), friend->typing_item);
+
+    toxprpl_frame frame;
+    frame.type = TOXPRPL_FRAME_TYPING;
+    frame.u.typing.state = typing;
+    friend->typing_item = toxprpl_send_frame(friend, TOXPRPL_LANE_CONTROL,
+                                             &frame, toxprpl_typing_sent,
+                                             friend);
+    if (friend->typing_item != NULL)
+    {
+        friend->tx_typing = typing;
+        friend->tx_typing_at = now;
+    }
+    return (typing != TOXPRPL_TYPING_NONE) ? TOXPRPL_TYPING_REFRESH : 0;
 }
 
-static int toxprpl_tox_addfriend(const char *buddy_key)
+/*
+ * returns the friend number or a negative errno value, only tells the user
+ * about errors if notify is set, gateway clients get the errno instead
+ */
+static int toxprpl_tox_addfriend(const char *buddy_key, gboolean notify)
 {
-    unsigned char *bin_key = toxprpl_tox_hex_string_to_id(buddy_key);
-    if (!bin_key)
+    uint8_t bin_key[CLIENT_ID_SIZE];
+    if (!toxprpl_tox_hex_string_to_id(buddy_key, bin_key))
     {
-        purple_debug_info("toxprpl", "Can not allocate memory for key\n");
-        return -1;
+        purple_debug_info("toxprpl", "Invalid key %s\n", buddy_key);
+        if (notify)
+        {
+            purple_notify_error(g_tox_gc, _("Error"), _("Invalid Tox ID"),
+                                NULL);
+        }
+        return -EINVAL;
     }
     int ret = m_addfriend(bin_key, DEFAULT_REQUEST_MESSAGE,
                                    strlen(DEFAULT_REQUEST_MESSAGE) + 1);
-    free(bin_key);
     const char *msg;
+    int err;
     switch (ret)
     {
         case -1:
             msg = "Message too long";
+            err = -EMSGSIZE;
             break;
         case -2:
             msg = "Missing request message";
+            err = -ENOMSG;
             break;
         case -3:
             msg = "You're trying to add yourself as a friend";
+            err = -ELOOP;
             break;
         case -4:
             msg = "Friend request already sent";
+            err = -EALREADY;
             break;
         case -5:
             msg = "Error adding friend";
+            err = -EIO;
             break;
         default:
             purple_debug_info("toxprpl", "Friend %s added\n", buddy_key);
-            break;
+            return ret;
     }
 
-    if (ret < 0)
+    purple_debug_info("toxprpl", "Could not add %s: %s\n", buddy_key, msg);
+    if (notify)
     {
         purple_notify_error(g_tox_gc, _("Error"), msg, NULL);
     }
-    return ret;
+    return err;
 }
 
 static void toxprpl_do_not_add_to_buddylist(char *buddy_key)
@@ -712,21 +4547,13 @@ static void toxprpl_do_not_add_to_buddylist(char *buddy_key)
     g_free(buddy_key);
 }
 
-static void toxprpl_add_to_buddylist(char *buddy_key)
+/* returns 0 or a negative errno value, see toxprpl_tox_addfriend() */
+static int toxprpl_add_friend(const char *buddy_key, gboolean notify)
 {
-    if (g_tox_gc == NULL)
-    {
-        purple_debug_info("toxprpl", "Can't add buddy %s invalid connection\n",
-                          buddy_key);
-        return;
-    }
-
-    int ret = toxprpl_tox_addfriend(buddy_key);
+    int ret = toxprpl_tox_addfriend(buddy_key, notify);
     if (ret < 0)
     {
-        g_free(buddy_key);
-        // error dialogs handled in toxprpl_tox_addfriend()
-        return;
+        return ret;
     }
 
     PurpleAccount *account = purple_connection_get_account(g_tox_gc);
@@ -754,7 +4581,21 @@ static void toxprpl_add_to_buddylist(char *buddy_key)
             buddy_key, userstatus);
     purple_prpl_got_user_status(account, buddy_key,
         toxprpl_statuses[toxprpl_get_status_index(ret, userstatus)].id, NULL);
+    return 0;
+}
 
+/* answer of the friend request dialog, takes ownership of the key */
+static void toxprpl_add_to_buddylist(char *buddy_key)
+{
+    if (g_tox_gc == NULL)
+    {
+        purple_debug_info("toxprpl", "Can't add buddy %s invalid connection\n",
+                          buddy_key);
+    }
+    else
+    {
+        toxprpl_add_friend(buddy_key, TRUE);
+    }
     g_free(buddy_key);
 }
 
@@ -770,7 +4611,7 @@ static void toxprpl_add_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
         return;
     }
 
-    int ret = toxprpl_tox_addfriend(buddy->name);
+    int ret = toxprpl_tox_addfriend(buddy->name, TRUE);
     if (ret < 0)
     {
         purple_blist_remove_buddy(buddy);
@@ -784,10 +4625,12 @@ static void toxprpl_remove_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
         PurpleGroup *group)
 {
     purple_debug_info("toxprpl", "removing buddy %s\n", buddy->name);
+    toxprpl_presence_remove(g_tox_presence, buddy->name);
     toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
     if (buddy_data != NULL)
     {
         purple_debug_info("toxprpl", "removing tox friend #%d\n", buddy_data->tox_friendlist_number);
+        toxprpl_friend_remove(buddy_data->tox_friendlist_number);
         m_delfriend(buddy_data->tox_friendlist_number);
     }
 }
@@ -823,24 +4666,24 @@ static PurplePluginProtocolInfo prpl_info =
         0,                               /* min_height */
         128,                             /* max_width */
         128,                             /* max_height */
-        10000,                           /* max_filesize */
+        TOXPRPL_ICON_MAX,                /* max_filesize */
         PURPLE_ICON_SCALE_DISPLAY,       /* scale_rules */
     },
     toxprpl_list_icon,                   /* list_icon */
     NULL,                                      /* list_emblem */
-    NULL,                                      /* status_text */
-    NULL,                                      /* tooltip_text */
+    toxprpl_status_text,                /* status_text */
+    toxprpl_tooltip_text,               /* tooltip_text */
     toxprpl_status_types,               /* status_types */
     NULL,                                      /* blist_node_menu */
-    NULL,                                      /* chat_info */
-    NULL,                                      /* chat_info_defaults */
+    toxprpl_chat_info,                         /* chat_info */
+    toxprpl_chat_info_defaults,                /* chat_info_defaults */
     toxprpl_login,                      /* login */
     toxprpl_close,                      /* close */
     toxprpl_send_im,                    /* send_im */
     NULL,                                      /* set_info */
-    NULL,                                      /* send_typing */
-    NULL,                                      /* get_info */
-    NULL,                                      /* set_status */
+    toxprpl_send_typing,                /* send_typing */
+    toxprpl_get_info,                   /* get_info */
+    toxprpl_set_status,                 /* set_status */
     NULL,                                      /* set_idle */
     NULL,                                      /* change_passwd */
     NULL,                                      /* add_buddy */
@@ -852,13 +4695,13 @@ static PurplePluginProtocolInfo prpl_info =
     NULL,                                      /* rem_permit */
     NULL,                                      /* rem_deny */
     NULL,                                      /* set_permit_deny */
-    NULL,                                      /* join_chat */
+    toxprpl_join_chat,                         /* join_chat */
     NULL,                                      /* reject_chat */
-    NULL,                                      /* get_chat_name */
-    NULL,                                      /* chat_invite */
-    NULL,                                      /* chat_leave */
+    toxprpl_get_chat_name,                     /* get_chat_name */
+    toxprpl_chat_invite,                       /* chat_invite */
+    toxprpl_chat_leave,                        /* chat_leave */
     NULL,                                      /* chat_whisper */
-    NULL,                                      /* chat_send */
+    toxprpl_chat_send,                         /* chat_send */
     NULL,                                      /* keepalive */
     NULL,                                      /* register_user */
     NULL,                                      /* get_cb_info */
@@ -869,7 +4712,7 @@ static PurplePluginProtocolInfo prpl_info =
     toxprpl_free_buddy,                  /* buddy_free */
     NULL,                                      /* convo_closed */
     NULL,                                      /* normalize */
-    NULL,                                      /* set_buddy_icon */
+    toxprpl_set_buddy_icon,                    /* set_buddy_icon */
     NULL,                                      /* remove_group */
     NULL,                                      /* get_cb_real_name */
     NULL,                                      /* set_chat_topic */
@@ -902,16 +4745,7 @@ static void toxprpl_init(PurplePlugin *plugin)
 {
     purple_debug_info("toxprpl", "starting up\n");
 
-    initMessenger();
-    //m_callback_friendrequest(on_friend_request);
-    m_callback_friendmessage(on_incoming_message);
-    m_callback_namechange(on_nick_change);
-    m_callback_userstatus(on_status_change);
-    m_callback_friendrequest(on_request);
-    m_callback_friendstatus(on_friendstatus);
-
-    purple_debug_info("toxprpl", "initialized tox callbacks\n");
-
+    // toxcore itself is initialized on first login, see toxprpl_tox_init()
     PurpleAccountOption *option = purple_account_option_string_new(
         _("Server"), "dht_server", DEFAULT_SERVER_IP);
     prpl_info.protocol_options = g_list_append(NULL, option);
@@ -925,26 +4759,32 @@ static void toxprpl_init(PurplePlugin *plugin)
         "dht_server_key", DEFAULT_SERVER_KEY);
     prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
                                                option);
+
+    option = purple_account_option_int_new(
+        _("Broadcast rate (messages per second)"), "broadcast_rate",
+        TOXPRPL_BROADCAST_RATE);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_string_new(_("Gateway socket (bots)"),
+        "gateway_socket", "");
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_bool_new(
+        _("Headless, deliver only to gateway clients"), "headless", FALSE);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_string_new(
+        _("Record callback trace to"), "trace_file", "");
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
     purple_prefs_add_none("/plugins");
     purple_prefs_add_none("/plugins/prpl");
     purple_prefs_add_none("/plugins/prpl/tox");
-    const char *msg64 = purple_prefs_get_string("/plugins/prpl/tox/messenger");
-    if (msg64 != NULL)
-    {
-        purple_debug_info("toxprpl", "found preference data\n");
-        gsize out_len;
-        guchar *msg_data = g_base64_decode(msg64, &out_len);
-        if (msg_data && (out_len > 0))
-        {
-            Messenger_load((uint8_t *)msg_data, (uint32_t)out_len);
-            g_free(msg_data);
-        }
-    }
-    else
-    {
-        purple_debug_info("toxprpl", "preferences not found, adding\n", msg64);
-        purple_prefs_add_string("/plugins/prpl/tox/messenger", "");
-    }
+    // does nothing if the preference already exists
+    purple_prefs_add_string("/plugins/prpl/tox/messenger", "");
 
 
     g_tox_protocol = plugin;
@@ -953,23 +4793,8 @@ static void toxprpl_init(PurplePlugin *plugin)
 
 static void toxprpl_destroy(PurplePlugin *plugin)
 {
-    if (!g_logged_in)
-    {
-        return;
-    }
     purple_debug_info("toxprpl", "shutting down\n");
-    purple_timeout_remove(g_tox_messenger_timer);
-    purple_timeout_remove(g_tox_connection_timer);
-
-    uint32_t msg_size = Messenger_size();
-    guchar *msg_data = g_malloc0(msg_size);
-    Messenger_save((uint8_t *)msg_data);
-
-    gchar *msg64 = g_base64_encode(msg_data, msg_size);
-    purple_prefs_set_string("/plugins/prpl/tox/messenger", msg64);
-    g_free(msg64);
-    g_free(msg_data);
-    g_logged_in = 0;
+    toxprpl_tox_teardown();
 }
 
 
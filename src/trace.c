@@ -0,0 +1,401 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#ifdef HAVE_CONFIG_H
+#include "autoconfig.h"
+#endif
+
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+
+#include <debug.h>
+
+#include "trace.h"
+
+#define TRACE_HEADER_LEN        (TOXPRPL_TRACE_MAGIC_LEN + 1)
+#define TRACE_RECORD_LEN        19  // record without data
+#define TRACE_BUFFER_SIZE       (64 * 1024)
+#define REPLAY_SLICE            (20 * 1000) // us of work per wheel tick
+
+/*
+ * latency histogram with 8 linear sub-buckets per power of two, about 12%
+ * precision and no allocations no matter how long a soak run is
+ */
+#define HISTOGRAM_SUB_BITS      3
+#define HISTOGRAM_SUB           (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS       (64 * HISTOGRAM_SUB)
+
+struct _toxprpl_trace
+{
+    FILE *file;
+    gint64 start;
+};
+
+struct _toxprpl_replay
+{
+    gchar *buf;
+    gsize length;
+    gsize offset;
+    gboolean realtime;
+    toxprpl_wheel *wheel;
+    toxprpl_timer *timer;
+    toxprpl_replay_func dispatch;
+    toxprpl_replay_done_func done;
+    gpointer data;
+    guint passes;
+    guint pass;
+    gint64 start;
+    gint64 pass_start;
+    gint64 busy;
+    gint64 heap_start;
+    guint mid_pass;
+    gint64 heap_mid;
+    guint records;
+    gint64 latency_sum;
+    gint64 latency_max;
+    guint64 histogram[HISTOGRAM_BUCKETS];
+};
+
+static void put_u16(guint8 *p, guint16 value)
+{
+    p[0] = (value >> 8) & 0xff;
+    p[1] = value & 0xff;
+}
+
+static void put_u32(guint8 *p, guint32 value)
+{
+    p[0] = (value >> 24) & 0xff;
+    p[1] = (value >> 16) & 0xff;
+    p[2] = (value >> 8) & 0xff;
+    p[3] = value & 0xff;
+}
+
+static guint16 get_u16(const guint8 *p)
+{
+    return ((guint16)p[0] << 8) | (guint16)p[1];
+}
+
+static guint32 get_u32(const guint8 *p)
+{
+    return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) |
+           ((guint32)p[2] << 8) | (guint32)p[3];
+}
+
+toxprpl_trace *toxprpl_trace_open(const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        purple_debug_error("toxprpl", "trace: could not open %s: %s\n",
+                           path, strerror(errno));
+        return NULL;
+    }
+
+    // records are small and frequent, let stdio batch the writes
+    setvbuf(file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    fwrite(TOXPRPL_TRACE_MAGIC, 1, TOXPRPL_TRACE_MAGIC_LEN, file);
+    fputc(TOXPRPL_TRACE_VERSION, file);
+
+    toxprpl_trace *trace = g_new0(toxprpl_trace, 1);
+    trace->file = file;
+    trace->start = g_get_monotonic_time();
+    purple_debug_info("toxprpl", "trace: recording to %s\n", path);
+    return trace;
+}
+
+void toxprpl_trace_close(toxprpl_trace *trace)
+{
+    if (trace == NULL)
+    {
+        return;
+    }
+    fclose(trace->file);
+    g_free(trace);
+}
+
+void toxprpl_trace_write(toxprpl_trace *trace, toxprpl_trace_event event,
+                         int fnum, guint32 arg, const guint8 *data,
+                         guint16 length)
+{
+    guint8 header[TRACE_RECORD_LEN];
+
+    if (trace == NULL)
+    {
+        return;
+    }
+
+    guint64 time = g_get_monotonic_time() - trace->start;
+    header[0] = event;
+    put_u32(header + 1, time >> 32);
+    put_u32(header + 5, time & 0xffffffff);
+    put_u32(header + 9, (guint32)fnum);
+    put_u32(header + 13, arg);
+    put_u16(header + 17, length);
+
+    fwrite(header, 1, sizeof(header), trace->file);
+    if (length > 0)
+    {
+        fwrite(data, 1, length, trace->file);
+    }
+}
+
+void toxprpl_trace_flush(toxprpl_trace *trace)
+{
+    if (trace != NULL)
+    {
+        fflush(trace->file);
+    }
+}
+
+/* returns FALSE at the end of the trace */
+static gboolean replay_peek(toxprpl_replay *replay,
+                            toxprpl_trace_record *record)
+{
+    const guint8 *p = (const guint8 *)replay->buf + replay->offset;
+    gsize left = replay->length - replay->offset;
+
+    if (left < TRACE_RECORD_LEN)
+    {
+        return FALSE;
+    }
+
+    record->event = p[0];
+    record->time = ((guint64)get_u32(p + 1) << 32) | get_u32(p + 5);
+    record->fnum = (gint32)get_u32(p + 9);
+    record->arg = get_u32(p + 13);
+    record->length = get_u16(p + 17);
+    record->data = p + TRACE_RECORD_LEN;
+    return (left - TRACE_RECORD_LEN) >= record->length;
+}
+
+/* bytes of heap in use, -1 if the C library can not tell */
+static gint64 replay_heap_usage(void)
+{
+#if defined(HAVE_MALLINFO2)
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks;
+#elif defined(HAVE_MALLINFO)
+    struct mallinfo info = mallinfo();
+    return info.uordblks;
+#else
+    return -1;
+#endif
+}
+
+static guint histogram_index(guint64 value)
+{
+    if (value < HISTOGRAM_SUB)
+    {
+        return value;
+    }
+
+    guint msb = g_bit_nth_msf(value >> 32, -1);
+    msb = (msb != (guint)-1) ? msb + 32 : g_bit_nth_msf(value, -1);
+    guint sub = (value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1);
+    return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB + sub;
+}
+
+/* lower bound of the values counted in a bucket */
+static guint64 histogram_value(guint index)
+{
+    if (index < HISTOGRAM_SUB)
+    {
+        return index;
+    }
+
+    guint msb = index / HISTOGRAM_SUB + HISTOGRAM_SUB_BITS - 1;
+    guint64 sub = index % HISTOGRAM_SUB;
+    return (G_GUINT64_CONSTANT(1) << msb) |
+           (sub << (msb - HISTOGRAM_SUB_BITS));
+}
+
+static gint64 histogram_percentile(toxprpl_replay *replay, guint percent)
+{
+    guint64 rank = ((guint64)replay->records * percent) / 100;
+    guint64 seen = 0;
+    guint i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += replay->histogram[i];
+        if (seen > rank)
+        {
+            return MIN((gint64)histogram_value(i), replay->latency_max);
+        }
+    }
+    return replay->latency_max;
+}
+
+static void replay_account(toxprpl_replay *replay, gint64 latency)
+{
+    latency = MAX(latency, 0);
+    replay->records++;
+    replay->latency_sum += latency;
+    replay->latency_max = MAX(replay->latency_max, latency);
+    replay->histogram[histogram_index(latency)]++;
+}
+
+static void replay_finish(toxprpl_replay *replay)
+{
+    toxprpl_replay_stats stats;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.records = replay->records;
+    stats.passes = replay->pass;
+    stats.elapsed = g_get_monotonic_time() - replay->start;
+    stats.busy = replay->busy;
+    stats.heap_start = replay->heap_start;
+    stats.mid_pass = replay->mid_pass;
+    stats.heap_mid = replay->heap_mid;
+    stats.heap_end = replay_heap_usage();
+
+    if (replay->records > 0)
+    {
+        stats.latency_avg = replay->latency_sum / replay->records;
+        stats.latency_p50 = histogram_percentile(replay, 50);
+        stats.latency_p99 = histogram_percentile(replay, 99);
+        stats.latency_max = replay->latency_max;
+    }
+
+    purple_debug_info("toxprpl", "trace: replayed %u records in %"
+                      G_GINT64_FORMAT " us\n", stats.records, stats.elapsed);
+    replay->timer = NULL;
+    // may free the replay, do not touch it afterwards
+    replay->done(&stats, replay->data);
+}
+
+static gboolean replay_tick(gpointer data)
+{
+    toxprpl_replay *replay = (toxprpl_replay *)data;
+    toxprpl_trace_record record;
+    gint64 slice = g_get_monotonic_time();
+
+    while (replay_peek(replay, &record))
+    {
+        gint64 now = g_get_monotonic_time();
+        gint64 due = replay->pass_start + (gint64)record.time;
+
+        if (replay->realtime && (due > now))
+        {
+            toxprpl_wheel_reschedule(replay->wheel, replay->timer,
+                                     (due - now + 999) / 1000);
+            return TRUE;
+        }
+        if (!replay->realtime && ((now - slice) >= REPLAY_SLICE))
+        {
+            // give the main loop a chance, continue on the next tick
+            toxprpl_wheel_reschedule(replay->wheel, replay->timer, 0);
+            return TRUE;
+        }
+
+        replay->offset += TRACE_RECORD_LEN + record.length;
+        replay->dispatch(&record);
+
+        gint64 end = g_get_monotonic_time();
+        gint64 latency = replay->realtime ? (end - due) : (end - now);
+        replay_account(replay, latency);
+        replay->busy += end - now;
+    }
+
+    replay->pass++;
+    if (replay->pass == 1)
+    {
+        // the first pass warms up caches and arenas, compare against it
+        replay->heap_start = replay_heap_usage();
+    }
+    if (replay->pass == replay->mid_pass)
+    {
+        replay->heap_mid = replay_heap_usage();
+    }
+    if (replay->pass < replay->passes)
+    {
+        replay->offset = TRACE_HEADER_LEN;
+        replay->pass_start = g_get_monotonic_time();
+        toxprpl_wheel_reschedule(replay->wheel, replay->timer, 0);
+        return TRUE;
+    }
+
+    replay_finish(replay);
+    return FALSE;
+}
+
+toxprpl_replay *toxprpl_replay_new(const char *path, gboolean realtime,
+                                   guint passes, toxprpl_wheel *wheel,
+                                   toxprpl_replay_func dispatch,
+                                   toxprpl_replay_done_func done,
+                                   gpointer data)
+{
+    GError *error = NULL;
+    gchar *buf;
+    gsize length;
+
+    if (!g_file_get_contents(path, &buf, &length, &error))
+    {
+        purple_debug_error("toxprpl", "trace: could not read %s: %s\n",
+                           path, error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    if ((length < TRACE_HEADER_LEN) ||
+        (memcmp(buf, TOXPRPL_TRACE_MAGIC, TOXPRPL_TRACE_MAGIC_LEN) != 0) ||
+        (buf[TOXPRPL_TRACE_MAGIC_LEN] != TOXPRPL_TRACE_VERSION))
+    {
+        purple_debug_error("toxprpl", "trace: %s is not a trace\n", path);
+        g_free(buf);
+        return NULL;
+    }
+
+    toxprpl_replay *replay = g_new0(toxprpl_replay, 1);
+    replay->buf = buf;
+    replay->length = length;
+    replay->offset = TRACE_HEADER_LEN;
+    replay->realtime = realtime;
+    replay->passes = MAX(passes, 1);
+    // the second half of the run starts well after the warm up pass
+    replay->mid_pass = (replay->passes >= 3) ? (replay->passes + 1) / 2 : 0;
+    replay->wheel = wheel;
+    replay->dispatch = dispatch;
+    replay->done = done;
+    replay->data = data;
+    replay->start = g_get_monotonic_time();
+    replay->pass_start = replay->start;
+    replay->timer = toxprpl_wheel_add(wheel, 0, 0, replay_tick, replay);
+    purple_debug_info("toxprpl", "trace: replaying %s %u time(s)%s\n", path,
+                      replay->passes, realtime ? " at the recorded pace" : "");
+    return replay;
+}
+
+void toxprpl_replay_free(toxprpl_replay *replay)
+{
+    if (replay == NULL)
+    {
+        return;
+    }
+    toxprpl_wheel_cancel(replay->wheel, replay->timer);
+    g_free(replay->buf);
+    g_free(replay);
+}
@@ -0,0 +1,120 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOXPRPL_TRACE_H__
+#define __TOXPRPL_TRACE_H__
+
+#include <glib.h>
+
+#include "wheel.h"
+
+/*
+ * Binary trace of toxcore callback invocations, used to turn captured load
+ * patterns into repeatable benchmarks. The file starts with "TXPT" and a
+ * version byte, followed by records of
+ *
+ *   u8 event, u64 time, i32 friend number, u32 argument, u16 length, data
+ *
+ * time is in microseconds since the trace was opened, all integers are big
+ * endian. A truncated last record (crash while recording) is ignored.
+ */
+
+#define TOXPRPL_TRACE_MAGIC         "TXPT"
+#define TOXPRPL_TRACE_MAGIC_LEN     4
+#define TOXPRPL_TRACE_VERSION       1
+
+typedef enum
+{
+    TOXPRPL_TRACE_MESSAGE = 1,      // data is the message
+    TOXPRPL_TRACE_NICK,             // data is the name
+    TOXPRPL_TRACE_STATUS_MESSAGE,   // data is the status message
+    TOXPRPL_TRACE_USERSTATUS,       // argument is the USERSTATUS
+    TOXPRPL_TRACE_FRIENDSTATUS,     // argument is the connection status
+    TOXPRPL_TRACE_REQUEST           // data is the public key + message
+} toxprpl_trace_event;
+
+typedef struct
+{
+    guint8 event;
+    guint64 time;
+    gint32 fnum;
+    guint32 arg;
+    const guint8 *data;
+    guint16 length;
+} toxprpl_trace_record;
+
+/* recording */
+typedef struct _toxprpl_trace toxprpl_trace;
+
+toxprpl_trace *toxprpl_trace_open(const char *path);
+void toxprpl_trace_close(toxprpl_trace *trace);
+
+/* does nothing if trace is NULL */
+void toxprpl_trace_write(toxprpl_trace *trace, toxprpl_trace_event event,
+                         int fnum, guint32 arg, const guint8 *data,
+                         guint16 length);
+
+/* push buffered records to disk */
+void toxprpl_trace_flush(toxprpl_trace *trace);
+
+/* replay */
+typedef struct _toxprpl_replay toxprpl_replay;
+
+typedef struct
+{
+    guint records;          // over all passes
+    guint passes;
+    gint64 elapsed;         // wall clock time of the whole run
+    gint64 busy;            // time spent in the dispatch callback
+    // per record: processing time when running as fast as possible,
+    // delay from the recorded time to completion when keeping the timing
+    gint64 latency_avg;
+    gint64 latency_p50;
+    gint64 latency_p99;
+    gint64 latency_max;
+    // heap in use after the first, the middle and the last pass, -1 if
+    // unknown. The middle pass is 0 for runs of less than three passes
+    gint64 heap_start;
+    guint mid_pass;
+    gint64 heap_mid;
+    gint64 heap_end;
+} toxprpl_replay_stats;
+
+typedef void (*toxprpl_replay_func)(const toxprpl_trace_record *record);
+
+/* called once when the trace is exhausted, may free the replay */
+typedef void (*toxprpl_replay_done_func)(const toxprpl_replay_stats *stats,
+                                         gpointer data);
+
+/*
+ * replays a trace on the wheel, either as fast as possible (in slices so
+ * the UI stays responsive) or at the recorded pace. With more than one pass
+ * the trace is run again and again, a soak run: heap usage must not grow
+ * after the first pass, and in particular not in the second half of the
+ * run, see toxprpl_replay_stats. Returns NULL if the file can not be read or is not
+ * a trace.
+ */
+toxprpl_replay *toxprpl_replay_new(const char *path, gboolean realtime,
+                                   guint passes, toxprpl_wheel *wheel,
+                                   toxprpl_replay_func dispatch,
+                                   toxprpl_replay_done_func done,
+                                   gpointer data);
+void toxprpl_replay_free(toxprpl_replay *replay);
+
+#endif
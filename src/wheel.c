@@ -0,0 +1,465 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "autoconfig.h"
+#endif
+
+#include <eventloop.h>
+
+#include "wheel.h"
+
+/*
+ * 4 levels of 64 slots: level 0 covers the next 64 ticks, level 1 the next
+ * 64 * 64 ticks and so on. Timers on higher levels are cascaded down when
+ * the lower level wraps around.
+ */
+#define WHEEL_LEVELS    4
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_MAX_DELTA ((G_GUINT64_CONSTANT(1) << \
+                          (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+typedef struct _wheel_link
+{
+    struct _wheel_link *prev;
+    struct _wheel_link *next;
+} wheel_link;
+
+struct _toxprpl_timer
+{
+    wheel_link link;        // must be first, links are cast to timers
+    guint64 expires;        // in ticks
+    guint period;           // in ticks, 0 for one-shot timers
+    toxprpl_timer_func func;
+    gpointer data;
+    gboolean cancelled;
+    gboolean rescheduled;
+};
+
+struct _toxprpl_wheel
+{
+    wheel_link slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    wheel_link expired;     // timers of the tick being dispatched
+    wheel_link spare;       // released timers, reused by toxprpl_wheel_add()
+    guint64 current;        // next tick to be processed
+    gint64 start;           // monotonic time of tick 0
+    guint resolution;       // tick length in milliseconds
+    guint count;
+    guint source;
+    guint64 armed;          // tick the source is armed for
+    toxprpl_timer *running;
+    gboolean dispatching;
+    gboolean destroyed;
+};
+
+static void link_init(wheel_link *head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static gboolean link_empty(wheel_link *head)
+{
+    return head->next == head;
+}
+
+static void link_add_tail(wheel_link *head, wheel_link *link)
+{
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+static void link_del(wheel_link *link)
+{
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link_init(link);
+}
+
+/* moves all entries of from to the empty list to */
+static void link_splice(wheel_link *from, wheel_link *to)
+{
+    if (link_empty(from))
+    {
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    link_init(from);
+}
+
+static guint64 wheel_now(toxprpl_wheel *wheel)
+{
+    return (g_get_monotonic_time() - wheel->start) /
+           ((gint64)wheel->resolution * 1000);
+}
+
+static guint64 wheel_ticks(toxprpl_wheel *wheel, guint ms)
+{
+    return (ms + wheel->resolution - 1) / wheel->resolution;
+}
+
+static void wheel_insert(toxprpl_wheel *wheel, toxprpl_timer *timer)
+{
+    guint64 expires = MAX(timer->expires, wheel->current);
+    guint64 delta = expires - wheel->current;
+    int level;
+
+    if (delta > WHEEL_MAX_DELTA)
+    {
+        // parked on the top level, cascading will put it back in place
+        delta = WHEEL_MAX_DELTA;
+        expires = wheel->current + delta;
+    }
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    {
+        if (delta < (G_GUINT64_CONSTANT(1) << (WHEEL_BITS * (level + 1))))
+        {
+            break;
+        }
+    }
+
+    guint index = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    link_add_tail(&wheel->slots[level][index], &timer->link);
+}
+
+/* re-sorts the timers of a higher level slot, returns the slot index */
+static guint wheel_cascade(toxprpl_wheel *wheel, int level)
+{
+    wheel_link list;
+    guint index = (wheel->current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    link_init(&list);
+    link_splice(&wheel->slots[level][index], &list);
+    while (!link_empty(&list))
+    {
+        wheel_link *link = list.next;
+        link_del(link);
+        wheel_insert(wheel, (toxprpl_timer *)link);
+    }
+    return index;
+}
+
+/*
+ * keeps the timer for the next toxprpl_wheel_add(), the spare list never
+ * holds more timers than were pending at once
+ */
+static void wheel_release(toxprpl_wheel *wheel, toxprpl_timer *timer)
+{
+    wheel->count--;
+    link_add_tail(&wheel->spare, &timer->link);
+}
+
+static void wheel_run(toxprpl_wheel *wheel, toxprpl_timer *timer)
+{
+    wheel->running = timer;
+    timer->rescheduled = FALSE;
+    gboolean again = timer->func(timer->data);
+    wheel->running = NULL;
+
+    if (timer->cancelled)
+    {
+        wheel_release(wheel, timer);
+    }
+    else if (timer->rescheduled)
+    {
+        wheel_insert(wheel, timer);
+    }
+    else if ((timer->period > 0) && again)
+    {
+        // keep the phase, but do not try to catch up on missed periods
+        timer->expires = MAX(timer->expires + timer->period, wheel->current);
+        wheel_insert(wheel, timer);
+    }
+    else
+    {
+        wheel_release(wheel, timer);
+    }
+}
+
+static void wheel_advance(toxprpl_wheel *wheel, guint64 now)
+{
+    if (wheel->count == 0)
+    {
+        wheel->current = MAX(wheel->current, now + 1);
+        return;
+    }
+
+    while ((wheel->current <= now) && !wheel->destroyed)
+    {
+        guint index = wheel->current & WHEEL_MASK;
+        int level;
+
+        for (level = 1; (index == 0) && (level < WHEEL_LEVELS); level++)
+        {
+            index = wheel_cascade(wheel, level);
+        }
+
+        link_splice(&wheel->slots[0][wheel->current & WHEEL_MASK],
+                    &wheel->expired);
+        // timers added from callbacks must not land in the slot we are
+        // emptying right now
+        wheel->current++;
+
+        while (!link_empty(&wheel->expired) && !wheel->destroyed)
+        {
+            wheel_link *link = wheel->expired.next;
+            link_del(link);
+            wheel_run(wheel, (toxprpl_timer *)link);
+        }
+    }
+}
+
+/* the tick at which something has to happen next */
+static guint64 wheel_next_tick(toxprpl_wheel *wheel)
+{
+    guint64 tick = wheel->current;
+
+    // at the latest when level 0 wraps around, higher levels have to be
+    // cascaded then
+    while (link_empty(&wheel->slots[0][tick & WHEEL_MASK]) &&
+           ((tick & WHEEL_MASK) != 0))
+    {
+        tick++;
+    }
+    return tick;
+}
+
+static gboolean wheel_dispatch(gpointer data);
+
+static void wheel_arm(toxprpl_wheel *wheel)
+{
+    if (wheel->dispatching)
+    {
+        // wheel_dispatch() arms the source when it is done
+        return;
+    }
+
+    if (wheel->count == 0)
+    {
+        if (wheel->source != 0)
+        {
+            purple_timeout_remove(wheel->source);
+            wheel->source = 0;
+        }
+        return;
+    }
+
+    guint64 next = wheel_next_tick(wheel);
+    if ((wheel->source != 0) && (wheel->armed == next))
+    {
+        return;
+    }
+
+    if (wheel->source != 0)
+    {
+        purple_timeout_remove(wheel->source);
+    }
+
+    gint64 deadline = wheel->start +
+                      (gint64)next * wheel->resolution * 1000;
+    gint64 delay = (deadline - g_get_monotonic_time() + 999) / 1000;
+    wheel->armed = next;
+    wheel->source = purple_timeout_add(MAX(delay, 0), wheel_dispatch, wheel);
+}
+
+static void wheel_free_list(toxprpl_wheel *wheel, wheel_link *head)
+{
+    while (!link_empty(head))
+    {
+        wheel_link *link = head->next;
+        link_del(link);
+        wheel_release(wheel, (toxprpl_timer *)link);
+    }
+}
+
+static void wheel_destroy(toxprpl_wheel *wheel)
+{
+    int level;
+    guint index;
+
+    if (wheel->source != 0)
+    {
+        purple_timeout_remove(wheel->source);
+    }
+    for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (index = 0; index < WHEEL_SLOTS; index++)
+        {
+            wheel_free_list(wheel, &wheel->slots[level][index]);
+        }
+    }
+    wheel_free_list(wheel, &wheel->expired);
+    while (!link_empty(&wheel->spare))
+    {
+        wheel_link *link = wheel->spare.next;
+        link_del(link);
+        g_free(link);
+    }
+    g_free(wheel);
+}
+
+static gboolean wheel_dispatch(gpointer data)
+{
+    toxprpl_wheel *wheel = (toxprpl_wheel *)data;
+
+    wheel->source = 0;
+    wheel->dispatching = TRUE;
+    wheel_advance(wheel, wheel_now(wheel));
+    wheel->dispatching = FALSE;
+
+    if (wheel->destroyed)
+    {
+        wheel_destroy(wheel);
+        return FALSE;
+    }
+
+    wheel_arm(wheel);
+    return FALSE;
+}
+
+toxprpl_wheel *toxprpl_wheel_new(guint resolution)
+{
+    int level;
+    guint index;
+    toxprpl_wheel *wheel = g_new0(toxprpl_wheel, 1);
+
+    for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (index = 0; index < WHEEL_SLOTS; index++)
+        {
+            link_init(&wheel->slots[level][index]);
+        }
+    }
+    link_init(&wheel->expired);
+    link_init(&wheel->spare);
+    wheel->resolution = MAX(resolution, 1);
+    wheel->start = g_get_monotonic_time();
+    return wheel;
+}
+
+void toxprpl_wheel_free(toxprpl_wheel *wheel)
+{
+    if (wheel == NULL)
+    {
+        return;
+    }
+
+    if (wheel->dispatching)
+    {
+        // called from a timer callback, wheel_dispatch() finishes the job
+        wheel->destroyed = TRUE;
+        if (wheel->running != NULL)
+        {
+            wheel->running->cancelled = TRUE;
+        }
+        return;
+    }
+    wheel_destroy(wheel);
+}
+
+toxprpl_timer *toxprpl_wheel_add(toxprpl_wheel *wheel, guint delay,
+                                 guint period, toxprpl_timer_func func,
+                                 gpointer data)
+{
+    toxprpl_timer *timer;
+
+    if (!link_empty(&wheel->spare))
+    {
+        timer = (toxprpl_timer *)wheel->spare.next;
+        link_del(&timer->link);
+        memset(timer, 0, sizeof(*timer));
+    }
+    else
+    {
+        timer = g_new0(toxprpl_timer, 1);
+    }
+
+    link_init(&timer->link);
+    timer->expires = wheel_now(wheel) + wheel_ticks(wheel, delay);
+    timer->period = (period > 0) ? MAX(wheel_ticks(wheel, period), 1) : 0;
+    timer->func = func;
+    timer->data = data;
+
+    wheel->count++;
+    wheel_insert(wheel, timer);
+    wheel_arm(wheel);
+    return timer;
+}
+
+void toxprpl_wheel_cancel(toxprpl_wheel *wheel, toxprpl_timer *timer)
+{
+    if (timer == NULL)
+    {
+        return;
+    }
+
+    if (timer == wheel->running)
+    {
+        timer->cancelled = TRUE;
+        return;
+    }
+
+    link_del(&timer->link);
+    wheel_release(wheel, timer);
+    if (wheel->count == 0)
+    {
+        wheel_arm(wheel);
+    }
+}
+
+void toxprpl_wheel_reschedule(toxprpl_wheel *wheel, toxprpl_timer *timer,
+                              guint delay)
+{
+    timer->expires = wheel_now(wheel) + wheel_ticks(wheel, delay);
+    if (timer == wheel->running)
+    {
+        timer->rescheduled = TRUE;
+        return;
+    }
+
+    link_del(&timer->link);
+    wheel_insert(wheel, timer);
+    wheel_arm(wheel);
+}
+
+guint toxprpl_wheel_remaining(toxprpl_wheel *wheel, toxprpl_timer *timer)
+{
+    guint64 now = wheel_now(wheel);
+    if (timer->expires <= now)
+    {
+        return 0;
+    }
+    return (timer->expires - now) * wheel->resolution;
+}
+
+guint toxprpl_wheel_count(toxprpl_wheel *wheel)
+{
+    return wheel->count;
+}
@@ -0,0 +1,65 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOXPRPL_WHEEL_H__
+#define __TOXPRPL_WHEEL_H__
+
+#include <glib.h>
+
+/*
+ * Hierarchical timer wheel, all periodic and one-shot work of a connection
+ * is scheduled here. Adding, cancelling and rescheduling a timer is O(1),
+ * the wheel keeps a single libpurple timeout armed for the next deadline,
+ * no matter how many timers are pending.
+ */
+
+typedef struct _toxprpl_wheel toxprpl_wheel;
+typedef struct _toxprpl_timer toxprpl_timer;
+
+/*
+ * return TRUE to keep a periodic timer running, the return value of
+ * one-shot timers is ignored. The timer handle is invalid after a one-shot
+ * timer fired or a periodic timer returned FALSE.
+ */
+typedef gboolean (*toxprpl_timer_func)(gpointer data);
+
+/* resolution is the length of a wheel tick in milliseconds */
+toxprpl_wheel *toxprpl_wheel_new(guint resolution);
+
+/* cancels all pending timers */
+void toxprpl_wheel_free(toxprpl_wheel *wheel);
+
+/* period 0 creates a one-shot timer */
+toxprpl_timer *toxprpl_wheel_add(toxprpl_wheel *wheel, guint delay,
+                                 guint period, toxprpl_timer_func func,
+                                 gpointer data);
+
+/* safe to call from within the callback of the timer itself */
+void toxprpl_wheel_cancel(toxprpl_wheel *wheel, toxprpl_timer *timer);
+
+/* moves a pending timer to now + delay, used for debouncing */
+void toxprpl_wheel_reschedule(toxprpl_wheel *wheel, toxprpl_timer *timer,
+                              guint delay);
+
+/* milliseconds until the timer fires */
+guint toxprpl_wheel_remaining(toxprpl_wheel *wheel, toxprpl_timer *timer);
+
+guint toxprpl_wheel_count(toxprpl_wheel *wheel);
+
+#endif